@@ -4,9 +4,10 @@ tandis que le reste provient du dossier static/. On ne génère pas de HTML en
 back-end, donc tout le dynamisme est géré par JavaScript.
 """
 
+import copy
 import csv
 import os
-import shutil
+import threading
 import time
 import uvicorn
 
@@ -158,19 +159,36 @@ def download(user: str = Depends(authenticate)):
 # Téléversement de photos
 # -----------------------
 
+scanner = None
+scanner_lock = threading.Lock()
+
+def get_scanner():
+	"""
+	Démarre au premier téléversement le receipt-scanner résident, partagé
+	ensuite par toutes les requêtes. Ses mesures de performance sont
+	relayées dans le journal.
+	"""
+	global scanner
+	with scanner_lock:
+		if scanner is None:
+			scanner = kakeibo.receipt.Scanner(profile=True)
+		return scanner
+
 @api.post('/upload')
 def upload(picture: UploadFile, user: str = Depends(authenticate)):
 	"""
 	Reçoit une photo et appelle le moteur de lecture de reçus. Renvoie la
-	liste des reçus lus en JSON. On garde la photo pour archive dans le
-	dossier uploads/, afin d’améliorer le moteur.
+	liste des reçus lus en JSON. La photo est d’abord gardée pour archive
+	dans le dossier uploads/, afin d’améliorer le moteur, même si le scan
+	échoue. Elle est ensuite transmise au scanneur depuis la mémoire.
 	"""
-	os.makedirs('uploads', exist_ok=True)
-	destination = f"uploads/{generate_id()}"
-	with open(destination, "wb") as output:
-		shutil.copyfileobj(picture.file, output)
+	data = picture.file.read()
 	picture.file.close()
-	return { 'receipts': kakeibo.receipt.scan_pictures(destination) }
+
+	os.makedirs('uploads', exist_ok=True)
+	with open(f"uploads/{generate_id()}", "wb") as output:
+		output.write(data)
+	return { 'receipts': get_scanner().scan_image(data) }
 
 
 # Fonction principale
@@ -184,4 +202,9 @@ if __name__ == '__main__':
 	if os.path.exists('ssl'):
 		ssl_options['ssl_keyfile'] = 'ssl/key.pem'
 		ssl_options['ssl_certfile'] = 'ssl/cert.pem'
-	uvicorn.run('kakeibo.api:app', host='0.0.0.0', port=8443, reload=True, **ssl_options)
+	# Les mesures de receipt-scanner sont journalisées au niveau INFO. Avec
+	# reload, l’application tourne dans un processus lancé par uvicorn, qui
+	# applique lui-même cette configuration.
+	log_config = copy.deepcopy(uvicorn.config.LOGGING_CONFIG)
+	log_config['loggers']['kakeibo'] = { 'handlers': ['default'], 'level': 'INFO' }
+	uvicorn.run('kakeibo.api:app', host='0.0.0.0', port=8443, reload=True, log_config=log_config, **ssl_options)
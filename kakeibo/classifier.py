@@ -17,13 +17,50 @@ classificateur.
 	0799970009911990099000950940009949000099990003959911599099999700
 	0009999901998799099000993920029999000298991029908998999009990990
 	0002999900000110000999910089997105999800199991002999900099992000
+
+Avec --binary, ces deux entrées sont lues dans le format binaire de
+receipt-scanner --binary : une suite de trames composées d’un octet de type,
+d’une taille sur 4 octets petit-boutistes et du contenu. Les features y sont
+stockées à raison d’un octet par feature, lisible directement par numpy.
+
+Avec --dataset, l’entrainement lit plutôt le jeu de données écrit par
+receipt-scanner --compile --dataset, projeté en mémoire d’un seul mmap. Son
+format est décrit dans detector.cc ; les features y forment une matrice uint8
+que numpy lit sans copie ni conversion.
+
+Avec --export, le modèle entrainé est aussi écrit dans un format binaire lu par
+receipt-scanner --decode, qui peut ainsi reconnaitre les lettres sans Python.
+Toutes les valeurs sont petit-boutistes :
+
+	char     magic[8]        "KAKEIBO\\x02", le dernier octet étant la version
+	uint32   n_classes
+	uint32   n_features      64 pour des échantillons 8×8
+	uint32   n_vectors       nombre total de vecteurs support
+	float64  gamma           paramètre du noyau RBF
+	n_classes fois :
+	  uint32 longueur de l’étiquette en octets
+	  char   étiquette en UTF-8
+	  uint32 nombre de vecteurs support de la classe
+	float64  intercepts[n_classes * (n_classes - 1) / 2]
+	float64  vecteurs[n_vectors][n_features]
+	float64  coefficients[n_classes - 1][n_vectors]
+
+Les vecteurs support sont regroupés par classe, dans l’ordre des étiquettes.
+Les intercepts et coefficients sont ceux de libsvm en un-contre-un, et les
+features sont normalisées sur 9 comme pour l’entrainement.
+
+MODEL_VERSION change dès que les features de receipt-scanner changent de sens,
+et un modèle entrainé sur les anciennes est alors refusé, qu’il soit exporté ou
+enregistré par pickle, plutôt que de mal reconnaitre les lettres.
 """
 
 import argparse
 import collections
 import csv
+import mmap
 import numpy as np
 import pickle
+import struct
 import sklearn.metrics
 import sklearn.model_selection
 import sklearn.preprocessing
@@ -31,25 +68,93 @@ import sklearn.svm
 import sys
 
 
-def load_data():
-	"""Charge depuis l’entrée standard le CSV des échantillons."""
+FEATURES_COUNT = 64
+
+# Version 2 : moyennes par zone, plutôt qu’un redimensionnement bilinéaire.
+MODEL_VERSION = 2
+
+
+def read_frames(input, terminated=False):
+	"""
+	Lit les trames de receipt-scanner --binary depuis un flux binaire et
+	renvoie des paires (type, contenu). S’arrête à la fin du flux ou à la
+	trame « . » qui termine une requête de --serve. Avec terminated, le flux
+	ne doit pas finir avant cette trame, sinon EOFError est levée.
+	"""
+	while header := input.read(5):
+		frame_type = chr(header[0])
+		size = int.from_bytes(header[1:5], 'little')
+		payload = input.read(size) if size else b''
+		if len(header) < 5 or len(payload) < size:
+			raise EOFError('Trame de receipt-scanner tronquée.')
+		if frame_type == '.':
+			return
+		yield frame_type, payload
+	if terminated:
+		raise EOFError('Fin de la sortie de receipt-scanner avant la trame « . ».')
+
+
+def load_dataset(path):
+	"""
+	Charge un jeu de données écrit par receipt-scanner --compile --dataset.
+	Le fichier est projeté en mémoire, et les indices d’étiquette comme les
+	features sont lus directement dans la projection.
+	"""
+	with open(path, 'rb') as f:
+		data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+	if data[:8] != b'KAKEIBOD':
+		raise ValueError(f'{path} n’est pas un jeu de données.')
+	version, n_samples, n_labels, n_features, labels_offset, indices_offset, _, features_offset = \
+		struct.unpack_from('<IIIIQQQQ', data, 8)
+	if version != 1 or n_features != FEATURES_COUNT:
+		raise ValueError(f'{path} : version ou nombre de features non supporté.')
+
+	positions = np.frombuffer(data, dtype='<u4', count=n_labels + 1, offset=labels_offset)
+	start = labels_offset + positions.nbytes
+	labels = [data[start + a:start + b].decode() for a, b in zip(positions[:-1], positions[1:])]
+	y = np.frombuffer(data, dtype='<u4', count=n_samples, offset=indices_offset)
+	x = np.frombuffer(data, dtype=np.uint8, count=n_samples * n_features, offset=features_offset)
+	x = x.reshape(n_samples, n_features) / 9
+
+	# Les étiquettes sont déjà triées et indexées comme le ferait fit.
+	label_encoder = sklearn.preprocessing.LabelEncoder()
+	label_encoder.classes_ = np.array(labels)
+	return (label_encoder, x, y.astype(np.intp))
+
+
+def load_data(binary=False, dataset=None):
+	"""
+	Charge depuis l’entrée standard le CSV des échantillons, ou le jeu de
+	données dataset s’il est donné.
+	"""
+	if dataset:
+		return load_dataset(dataset)
+
 	x = []
 	y = []
-	for row in csv.reader(sys.stdin):
-		label = row[1]
-		features = [float(c) / 9 for c in row[2]]
-		x.append(features)
-		y.append(label)
+	if binary:
+		for frame_type, payload in read_frames(sys.stdin.buffer):
+			if frame_type != 'S':
+				continue
+			x.append(np.frombuffer(payload, dtype=np.uint8, count=FEATURES_COUNT))
+			y.append(payload[FEATURES_COUNT:].split(b'\0')[0].decode())
+		x = np.array(x, dtype=float) / 9
+	else:
+		for row in csv.reader(sys.stdin):
+			label = row[1]
+			features = [float(c) / 9 for c in row[2]]
+			x.append(features)
+			y.append(label)
+		x = np.array(x)
 
 	label_encoder = sklearn.preprocessing.LabelEncoder()
-	x = np.array(x)
 	y = label_encoder.fit_transform(y)
 	return (label_encoder, x, y)
 
 
-def train(test_ratio=0):
+def train(test_ratio=0, binary=False, dataset=None):
 	"""Entraine le modèle, et le teste si demandé."""
-	label_encoder, x_train, y_train = load_data()
+	label_encoder, x_train, y_train = load_data(binary, dataset)
 	if test_ratio != 0:
 		x_train, x_test, y_train, y_test = sklearn.model_selection.train_test_split(x_train, y_train, test_size=test_ratio)
 	classifier = sklearn.svm.SVC()
@@ -60,6 +165,42 @@ def train(test_ratio=0):
 	return (label_encoder, classifier)
 
 
+def export(model, output):
+	"""Écrit le modèle dans le format binaire lu par receipt-scanner --decode."""
+	label_encoder, classifier = model
+	if classifier.kernel != 'rbf':
+		raise ValueError('Seul le noyau RBF est exportable.')
+
+	# Les classes absentes de l’entrainement n’ont pas de vecteur support,
+	# donc on part des classes connues du classificateur.
+	labels = label_encoder.inverse_transform(classifier.classes_)
+	vectors = classifier.support_vectors_
+	output.write(b'KAKEIBO' + bytes([MODEL_VERSION]))
+	output.write(struct.pack('<IIId', len(labels), vectors.shape[1], vectors.shape[0], classifier._gamma))
+	for label, count in zip(labels, classifier.n_support_):
+		encoded = label.encode()
+		output.write(struct.pack('<I', len(encoded)))
+		output.write(encoded)
+		output.write(struct.pack('<I', count))
+	# _intercept_ et _dual_coef_ sont les valeurs brutes de libsvm, que
+	# scikit-learn inverse pour le cas binaire dans intercept_ et dual_coef_.
+	output.write(np.ascontiguousarray(classifier._intercept_, dtype='<f8').tobytes())
+	output.write(np.ascontiguousarray(vectors, dtype='<f8').tobytes())
+	output.write(np.ascontiguousarray(classifier._dual_coef_, dtype='<f8').tobytes())
+
+
+def save_model(model, output):
+	pickle.dump((MODEL_VERSION, model), output)
+
+
+def load_model(input):
+	"""Charge un modèle enregistré par save_model, s’il est de la bonne version."""
+	data = pickle.load(input)
+	if not (isinstance(data, tuple) and len(data) == 2 and data[0] == MODEL_VERSION):
+		raise ValueError(f'Modèle d’une autre version que {MODEL_VERSION}, à réentrainer.')
+	return data[1]
+
+
 def decode(model, input, output):
 	"""
 	Reçoit depuis l’io d’entrée des jeux de features (« mots ») séparés
@@ -77,11 +218,51 @@ def decode(model, input, output):
 		print(''.join(letters), file=output)
 
 
+def decode_letters(model, payload):
+	"""Reconnait chacune des lettres dont payload contient les features."""
+	label_encoder, classifier = model
+	x = np.frombuffer(payload, dtype=np.uint8).reshape(-1, FEATURES_COUNT) / 9
+	return label_encoder.inverse_transform(classifier.predict(x))
+
+
+def decode_lines(model, input, terminated=False):
+	"""
+	Reconnait les lettres de la sortie binaire de receipt-scanner --scan
+	--binary, avec ou sans --intern. Renvoie le texte de chaque ligne, et None
+	à la fin de chaque reçu. Avec --intern, chaque forme de lettre de la trame
+	D n’est reconnue qu’une fois pour tout le reçu. terminated a le même sens
+	que pour read_frames.
+	"""
+	shapes = None
+	for frame_type, payload in read_frames(input, terminated):
+		if frame_type == 'R':
+			yield None
+		elif frame_type == 'D':
+			shapes = decode_letters(model, payload) if payload else None
+		elif frame_type == 'I' and payload:
+			yield ''.join(shapes[np.frombuffer(payload, dtype='<u4')])
+		elif frame_type == 'L' and payload:
+			yield ''.join(decode_letters(model, payload))
+
+
+def decode_frames(model, input, output):
+	"""
+	Équivalent de decode pour la sortie binaire de receipt-scanner --scan
+	--binary. Chaque ligne reconnue devient une ligne de texte, et chaque fin
+	de reçu une ligne vide.
+	"""
+	for line in decode_lines(model, input):
+		print(line or '', file=output)
+
+
 def parse_args():
 	parser = argparse.ArgumentParser()
 	parser.add_argument('--decode', action='store_true')
 	parser.add_argument('--train', action='store_true')
 	parser.add_argument('--test', action='store_true')
+	parser.add_argument('--binary', action='store_true')
+	parser.add_argument('--export', metavar='EXPORT')
+	parser.add_argument('--dataset', metavar='DATASET')
 	parser.add_argument('model', metavar='MODEL', nargs='?')
 	args = parser.parse_args()
 
@@ -95,6 +276,15 @@ def parse_args():
 		if (args.train or args.decode) and args.model is None:
 			raise ValueError('Modèle requis.')
 
+		if args.export and not args.train:
+			raise ValueError('--export requiert --train.')
+
+		if args.dataset and args.decode:
+			raise ValueError('--dataset requiert --train ou --test.')
+
+		if args.dataset and args.binary:
+			raise ValueError('--dataset et --binary sont incompatibles.')
+
 	except ValueError as e:
 		parser.print_usage()
 		print(e, file=sys.stderr)
@@ -106,12 +296,18 @@ def parse_args():
 if __name__ == '__main__':
 	args = parse_args()
 	if args.test:
-		train(test_ratio=0.5)
+		train(test_ratio=0.5, binary=args.binary, dataset=args.dataset)
 	elif args.train:
-		model = train()
+		model = train(binary=args.binary, dataset=args.dataset)
 		with open(args.model, 'wb') as f:
-			pickle.dump(model, f)
+			save_model(model, f)
+		if args.export:
+			with open(args.export, 'wb') as f:
+				export(model, f)
 	else:
 		with open(args.model, 'rb') as f:
-			model = pickle.load(f)
-		decode(model, input=sys.stdin, output=sys.stdout)
+			model = load_model(f)
+		if args.binary:
+			decode_frames(model, input=sys.stdin.buffer, output=sys.stdout)
+		else:
+			decode(model, input=sys.stdin, output=sys.stdout)
@@ -0,0 +1,167 @@
+"""
+Liaison Python de libkakeibo, pour détecter, découper et scanner les reçus
+dans le processus même plutôt qu’en lançant receipt-scanner. Les images sont
+des tableaux numpy de forme (hauteur, largeur, 3), en uint8 et en BGR, comme
+ceux d’OpenCV, ou (hauteur, largeur) pour un reçu réduit à son canal rouge.
+
+ctypes relâche le GIL pendant chaque appel à la bibliothèque, donc plusieurs
+threads peuvent scanner en parallèle.
+
+La bibliothèque est cherchée dans KAKEIBO_LIBRARY, puis dans le dossier
+courant, puis dans build/.
+"""
+
+
+import ctypes
+import os
+
+import numpy as np
+
+
+API_VERSION = 2
+LETTER_FEATURES = 64
+LIBRARY_PATHS = ['./libkakeibo.so', 'build/libkakeibo.so']
+
+
+class Image(ctypes.Structure):
+	_fields_ = [
+		('data', ctypes.POINTER(ctypes.c_uint8)),
+		('rows', ctypes.c_int32),
+		('cols', ctypes.c_int32),
+		('channels', ctypes.c_int32),
+		('stride', ctypes.c_size_t),
+	]
+
+	@classmethod
+	def from_array(cls, array):
+		"""
+		Vue sur le tableau, sans copie tant que ses pixels sont contigus et
+		ses lignes dans l’ordre : le stride de kakeibo_image est positif.
+		"""
+		if array.dtype != np.uint8 or not (array.ndim == 2 or array.ndim == 3 and array.shape[2] == 3):
+			raise ValueError('Image BGR ou à un canal, en uint8, attendue.')
+		channels, pixel_strides = (1, (1,)) if array.ndim == 2 else (3, (3, 1))
+		if array.strides[0] <= 0 or array.strides[1:] != pixel_strides:
+			array = np.ascontiguousarray(array)
+		image = cls(array.ctypes.data_as(ctypes.POINTER(ctypes.c_uint8)), array.shape[0], array.shape[1], channels, array.strides[0])
+		# La structure ne garde qu’un pointeur : le tableau doit lui survivre.
+		image.array = array
+		return image
+
+
+class Quad(ctypes.Structure):
+	_fields_ = [('corners', ctypes.c_int32 * 8)]
+
+
+class Scan(ctypes.Structure):
+	_fields_ = [
+		('line_count', ctypes.c_uint32),
+		('line_lengths', ctypes.POINTER(ctypes.c_uint32)),
+		('letter_count', ctypes.c_uint32),
+		('features', ctypes.POINTER(ctypes.c_uint8)),
+	]
+
+
+class Error(Exception):
+	pass
+
+
+ERRORS = {
+	-1: 'image vide ou qui n’est pas en BGR',
+	-2: 'erreur interne de libkakeibo',
+}
+
+
+def check(result, function, arguments):
+	if result < 0:
+		raise Error(f'{function.__name__} : {ERRORS.get(result, result)}')
+	return result
+
+
+def load_library():
+	paths = [os.environ['KAKEIBO_LIBRARY']] if 'KAKEIBO_LIBRARY' in os.environ else LIBRARY_PATHS
+	path = next((path for path in paths if os.path.exists(path)), None)
+	if path is None:
+		raise Error('libkakeibo introuvable.')
+	library = ctypes.CDLL(path)
+	if library.kakeibo_api_version() != API_VERSION:
+		raise Error(f'{path} : version de l’API non supportée.')
+
+	image = ctypes.POINTER(Image)
+	for name, argtypes in [
+		('kakeibo_find_receipts', [image, ctypes.POINTER(Quad), ctypes.c_int]),
+		('kakeibo_cut_receipt', [image, ctypes.POINTER(Quad), image]),
+		('kakeibo_cut_receipt_red', [image, ctypes.POINTER(Quad), image]),
+		('kakeibo_scan_receipt', [image, ctypes.POINTER(Scan)]),
+	]:
+		function = getattr(library, name)
+		function.argtypes = argtypes
+		function.restype = ctypes.c_int
+		function.errcheck = check
+	library.kakeibo_free_image.argtypes = [image]
+	library.kakeibo_free_image.restype = None
+	library.kakeibo_free_scan.argtypes = [ctypes.POINTER(Scan)]
+	library.kakeibo_free_scan.restype = None
+	return library
+
+
+_library = None
+
+
+def library():
+	global _library
+	if _library is None:
+		_library = load_library()
+	return _library
+
+
+def find_receipts(photo, capacity=16):
+	"""Renvoie les coins de chaque reçu de la photo, en tableaux 4 × 2."""
+	image = Image.from_array(photo)
+	while True:
+		quads = (Quad * capacity)()
+		count = library().kakeibo_find_receipts(image, quads, capacity)
+		if count <= capacity:
+			return [np.array(q.corners).reshape(4, 2) for q in quads[:count]]
+		capacity = count
+
+
+def cut_receipt(photo, corners, red_only=False):
+	"""
+	Découpe et redresse le reçu dont corners donne les coins. Avec red_only,
+	seul le canal rouge est gardé, en tableau (hauteur, largeur) : c’est tout
+	ce que lit scan_receipt.
+	"""
+	quad = Quad((ctypes.c_int32 * 8)(*np.asarray(corners).ravel().tolist()))
+	result = Image()
+	cut = library().kakeibo_cut_receipt_red if red_only else library().kakeibo_cut_receipt
+	cut(Image.from_array(photo), quad, result)
+	try:
+		data = np.ctypeslib.as_array(result.data, shape=(result.rows, result.stride))
+		pixels = data[:, :result.cols * result.channels]
+		if result.channels == 1:
+			return pixels.copy()
+		return pixels.reshape(result.rows, result.cols, result.channels).copy()
+	finally:
+		library().kakeibo_free_image(result)
+
+
+def scan_receipt(receipt):
+	"""
+	Renvoie les features d’un reçu découpé, en tableau de LETTER_FEATURES
+	colonnes par lettre, et le nombre de lettres de chaque ligne.
+	"""
+	result = Scan()
+	library().kakeibo_scan_receipt(Image.from_array(receipt), result)
+	try:
+		features = np.ctypeslib.as_array(result.features, shape=(result.letter_count * LETTER_FEATURES,)).copy() \
+			if result.letter_count else np.empty(0, dtype=np.uint8)
+		line_lengths = result.line_lengths[:result.line_count]
+		return features.reshape(-1, LETTER_FEATURES), line_lengths
+	finally:
+		library().kakeibo_free_scan(result)
+
+
+def scan_photo(photo):
+	"""Équivalent de scan_receipt pour chaque reçu de la photo."""
+	return [scan_receipt(cut_receipt(photo, corners, red_only=True)) for corners in find_receipts(photo)]
@@ -13,14 +13,16 @@ image et renvoie une liste de JSON au format suivant :
 
 
 import argparse
-import io
 import json
-import pickle
+import logging
+import os
 import subprocess
 import sys
 import re
+import threading
 
 import kakeibo.classifier
+import kakeibo.native
 import kakeibo.stores
 
 
@@ -49,24 +51,239 @@ def parse_receipt(text):
 	return data or None
 
 
-def scan_pictures(*pictures_paths):
+def parse_receipts(text):
+	"""Découpe la sortie décodée en reçus, séparés par des lignes vides."""
+	return [receipt for text_block in text.split('\n\n') if (receipt := parse_receipt(text_block))]
+
+
+logger = logging.getLogger(__name__)
+
+
+# Modèle exporté par kakeibo.classifier --export. S’il est présent,
+# receipt-scanner reconnait lui-même les lettres et Python n’a plus qu’à
+# analyser le texte.
+NATIVE_MODEL = 'letters.svm'
+
+
+def load_model():
+	"""Renvoie le modèle Python, ou None si receipt-scanner décode lui-même."""
+	if os.path.exists(NATIVE_MODEL):
+		return None
 	with open('letters.model', 'rb') as f:
-		model = pickle.load(f)
+		return kakeibo.classifier.load_model(f)
 
-	decoded_io = io.StringIO()
-	with subprocess.Popen(['./receipt-scanner', '--', *pictures_paths], stdout=subprocess.PIPE, text=True) as scanner:
-		kakeibo.classifier.decode(model, input=scanner.stdout, output=decoded_io)
 
-	text = decoded_io.getvalue()
-	return [receipt for text_block in text.split('\n\n') if (receipt := parse_receipt(text_block))]
+def scanner_command(*arguments, profile=False):
+	"""
+	Sans modèle exporté, on demande les features en binaire pour éviter de
+	les reconvertir depuis du texte, et une seule fois par forme de lettre
+	pour ne reconnaitre chacune qu’une fois. Dans tous les cas, --stream
+	permet de traiter chaque reçu dès qu’il est prêt.
+	"""
+	if os.path.exists(NATIVE_MODEL):
+		options = ['--stream', '--decode', NATIVE_MODEL]
+	else:
+		options = ['--stream', '--binary', '--intern']
+	if profile:
+		options.append('--profile')
+	return ['./receipt-scanner', *options, *arguments]
+
+
+def forward_stderr(stream):
+	"""
+	Relaie la sortie d’erreur de receipt-scanner vers le journal. Les
+	enregistrements JSON de --profile sont journalisés tels quels, avec le
+	dictionnaire dans l’attribut receipt_scanner_profile. Une ligne qui ne
+	peut pas être relayée ne doit pas arrêter la lecture : le tube se
+	remplirait et bloquerait le scanneur.
+	"""
+	for line in stream:
+		try:
+			line = line.decode(errors='replace').rstrip('\n')
+			try:
+				record = json.loads(line)
+			except ValueError:
+				record = None
+			if isinstance(record, dict):
+				logger.info('receipt-scanner profile: %s', line, extra={'receipt_scanner_profile': record})
+			else:
+				logger.warning('receipt-scanner: %s', line)
+		except Exception:
+			logger.exception('Ligne de receipt-scanner non relayée.')
+
+
+def start_forwarding(process):
+	"""Lit la sortie d’erreur dans un thread, pour ne jamais bloquer le scanneur."""
+	thread = threading.Thread(target=forward_stderr, args=(process.stderr,), daemon=True)
+	thread.start()
+	return thread
+
+
+def read_receipts(model, input, terminated=False):
+	"""
+	Renvoie le texte de chaque reçu de la sortie de receipt-scanner --stream,
+	dès que sa fin est lue, en reconnaissant les lettres si receipt-scanner ne
+	l’a pas déjà fait. input est lu jusqu’à la fin du flux ou de la requête
+	--serve en cours. Avec terminated, pour --serve, EOFError est levée si le
+	flux se termine avant la fin de la requête.
+	"""
+	lines = []
+	if model is None:
+		for line in input:
+			if line == b'.\n':
+				break
+			if line == b'\n':
+				yield ''.join(lines)
+				lines = []
+			else:
+				lines.append(line.decode())
+		else:
+			if terminated:
+				raise EOFError('Fin de la sortie de receipt-scanner avant la ligne « . ».')
+	else:
+		for line in kakeibo.classifier.decode_lines(model, input, terminated):
+			if line is None:
+				yield ''.join(lines)
+				lines = []
+			else:
+				lines.append(line + '\n')
+	if lines:
+		yield ''.join(lines)
+
+
+def stream_pictures(*pictures_paths, profile=False):
+	"""
+	Équivalent de scan_pictures qui renvoie chaque reçu dès qu’il est analysé,
+	pendant que receipt-scanner traite les suivants.
+	"""
+	model = load_model()
+
+	command = scanner_command('--', *pictures_paths, profile=profile)
+	stderr = subprocess.PIPE if profile else None
+	with subprocess.Popen(command, stdout=subprocess.PIPE, stderr=stderr) as scanner:
+		forwarder = start_forwarding(scanner) if profile else None
+		for text in read_receipts(model, scanner.stdout):
+			if receipt := parse_receipt(text):
+				yield receipt
+	if forwarder:
+		forwarder.join()
+
+
+def scan_pictures(*pictures_paths, profile=False):
+	return list(stream_pictures(*pictures_paths, profile=profile))
+
+
+def scan_array(photo, model):
+	"""
+	Équivalent de Scanner.scan pour une photo déjà décodée, en tableau numpy
+	BGR, scannée dans le processus même par libkakeibo, sans receipt-scanner.
+	Le GIL est relâché pendant le scan. model est le modèle Python de
+	kakeibo.classifier, chargé depuis letters.model.
+	"""
+	receipts = []
+	for features, line_lengths in kakeibo.native.scan_photo(photo):
+		letters = kakeibo.classifier.decode_letters(model, features.tobytes()) if len(features) else []
+		lines = []
+		start = 0
+		for length in line_lengths:
+			lines.append(''.join(letters[start:start + length]) + '\n')
+			start += length
+		if receipt := parse_receipt(''.join(lines)):
+			receipts.append(receipt)
+	return receipts
+
+
+class Scanner:
+	"""
+	Garde un receipt-scanner --serve résident avec le modèle chargé, pour
+	éviter de relancer un processus et de recharger le modèle à chaque photo.
+	Les requêtes sont sérialisées, donc une même instance peut être partagée
+	entre plusieurs threads.
+
+	Avec profile, les mesures de receipt-scanner --profile sont relayées
+	vers le journal du module.
+
+	Si le scanneur s’arrête en cours de requête, celle-ci lève RuntimeError,
+	et il est relancé à la requête suivante.
+	"""
+
+	def __init__(self, profile=False):
+		self.model = load_model()
+		self.profile = profile
+		self.lock = threading.Lock()
+		self.process = self.start()
+
+	def start(self):
+		process = subprocess.Popen(
+			scanner_command('--serve', profile=self.profile),
+			stdin=subprocess.PIPE,
+			stdout=subprocess.PIPE,
+			stderr=subprocess.PIPE if self.profile else None,
+		)
+		if self.profile:
+			start_forwarding(process)
+		return process
+
+	def scan(self, picture_path):
+		"""Lit les reçus de la photo et renvoie la même liste que scan_pictures."""
+		return self.request(f"scan {picture_path}\n".encode())
+
+	def scan_image(self, data):
+		"""
+		Équivalent de scan pour une photo déjà en mémoire, sous forme de
+		fichier encodé. Elle est transmise telle quelle au scanneur, qui la
+		décode sans passer par le disque.
+		"""
+		return self.request(f"scan - {len(data)}\n".encode(), data)
+
+	def request(self, header, data=b''):
+		"""
+		Chaque reçu est analysé dès que le scanneur l’a écrit, pendant qu’il
+		traite les suivants.
+
+		Si la lecture ou l’analyse échoue avant la fin de la réponse, la suite
+		de celle-ci resterait dans le tube et serait lue par la requête
+		suivante : le scanneur est donc arrêté, pour être relancé à la
+		prochaine requête.
+		"""
+		receipts = []
+		with self.lock:
+			if self.process.poll() is not None:
+				logger.warning('receipt-scanner --serve relancé après son arrêt (code %d).', self.process.returncode)
+				self.process = self.start()
+			try:
+				self.process.stdin.write(header)
+				self.process.stdin.write(data)
+				self.process.stdin.flush()
+				for text in read_receipts(self.model, self.process.stdout, terminated=True):
+					if receipt := parse_receipt(text):
+						receipts.append(receipt)
+			except (BrokenPipeError, EOFError) as e:
+				self.process.kill()
+				returncode = self.process.wait()
+				raise RuntimeError(f'receipt-scanner --serve s’est arrêté (code {returncode}).') from e
+			except BaseException:
+				self.process.kill()
+				self.process.wait()
+				raise
+		return receipts
+
+	def close(self):
+		with self.lock:
+			self.process.stdin.write(b"quit\n")
+			self.process.stdin.close()
+			self.process.wait()
 
 
 if __name__ == '__main__':
 	parser = argparse.ArgumentParser()
 	parser.add_argument('--format', choices=['json', 'tsv'], default='json')
+	parser.add_argument('--profile', action='store_true')
 	parser.add_argument('pictures', metavar='PICTURE', nargs='+')
 	args = parser.parse_args()
-	receipts = scan_pictures(*args.pictures)
+	if args.profile:
+		logging.basicConfig(level=logging.INFO)
+	receipts = scan_pictures(*args.pictures, profile=args.profile)
 
 	if args.format == 'json':
 		json.dump(receipts, sys.stdout, indent='\t', ensure_ascii=False)
@@ -0,0 +1,165 @@
+/*
+ * Moteur d’inférence du classificateur de lettres, pour que --scan puisse
+ * sortir directement le texte du reçu sans passer par Python.
+ *
+ * Le modèle est entrainé par kakeibo.classifier --train, puis exporté avec
+ * --export dans le format binaire décrit dans ce module Python. Il s’agit d’un
+ * SVC de scikit-learn à noyau RBF, multi-classe en un-contre-un : chaque paire
+ * de classes vote, et la classe ayant le plus de voix l’emporte. On reproduit
+ * ici la fonction de décision de libsvm, sur laquelle se base scikit-learn.
+ */
+
+#include "kakeibo.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+
+/**
+ * Lecteur minimaliste de valeurs petit-boutistes. ok passe à faux dès qu’une
+ * lecture échoue, ce qui permet de ne vérifier qu’à la fin.
+ */
+struct model_reader {
+	std::FILE* file;
+	bool ok = true;
+
+	template<typename T> T read()
+	{
+		T value {};
+		if (std::fread(&value, sizeof(T), 1, file) != 1)
+			ok = false;
+		return value;
+	}
+
+	void read_doubles(std::vector<double>& values, size_t count)
+	{
+		values.resize(count);
+		if (std::fread(values.data(), sizeof(double), count, file) != count)
+			ok = false;
+	}
+
+	std::string read_string()
+	{
+		std::string value(read<uint32_t>(), '\0');
+		if (ok && std::fread(value.data(), 1, value.size(), file) != value.size())
+			ok = false;
+		return value;
+	}
+};
+
+/**
+ * Le dernier octet de model_magic est la version du format, à incrémenter dès
+ * que les features changent de sens : un modèle entrainé sur les anciennes
+ * reconnaitrait mal les lettres sans que rien ne le signale. La version 2
+ * correspond aux moyennes par zone de extract_features.
+ */
+static const char model_magic[8] = { 'K', 'A', 'K', 'E', 'I', 'B', 'O', 2 };
+
+/**
+ * Lit le contenu d’un modèle, en vérifiant la cohérence des dimensions.
+ */
+static std::optional<svm_model> read_svm_model(model_reader& reader)
+{
+	char magic[8];
+	if (std::fread(magic, 1, 8, reader.file) != 8 || !std::equal(magic, magic + 7, model_magic))
+		return {};
+	if (magic[7] != model_magic[7]) {
+		std::fprintf(stderr, "Modèle de version %d plutôt que %d, à réentrainer.\n", magic[7], model_magic[7]);
+		return {};
+	}
+
+	svm_model model;
+	uint32_t class_count = reader.read<uint32_t>();
+	model.feature_count = reader.read<uint32_t>();
+	uint32_t vector_count = reader.read<uint32_t>();
+	model.gamma = reader.read<double>();
+	if (!reader.ok || class_count < 2 || model.feature_count != letter_features)
+		return {};
+
+	size_t offset = 0;
+	for (uint32_t i = 0; i < class_count; ++i) {
+		model.labels.push_back(reader.read_string());
+		model.support_offsets.push_back(offset);
+		offset += reader.read<uint32_t>();
+	}
+	model.support_offsets.push_back(offset);
+	if (!reader.ok || offset != vector_count)
+		return {};
+
+	reader.read_doubles(model.intercepts, class_count * (class_count - 1) / 2);
+	reader.read_doubles(model.support_vectors, vector_count * model.feature_count);
+	reader.read_doubles(model.coefficients, (class_count - 1) * vector_count);
+	if (!reader.ok)
+		return {};
+
+	return model;
+}
+
+/**
+ * Charge un modèle exporté par kakeibo.classifier --export. Renvoie un
+ * optional vide si le fichier est illisible ou mal formé.
+ */
+std::optional<svm_model> load_svm_model(const char* path)
+{
+	std::FILE* file = std::fopen(path, "rb");
+	if (!file)
+		return {};
+
+	model_reader reader { file };
+	std::optional<svm_model> model = read_svm_model(reader);
+	std::fclose(file);
+	return model;
+}
+
+/**
+ * Reçoit les letter_features valeurs d’une lettre, de 0 à 9, telles que
+ * générées par extract_features, et renvoie l’étiquette de la lettre reconnue.
+ */
+const std::string& svm_model::classify(const uint8_t* features) const
+{
+	size_t class_count = labels.size();
+	size_t vector_count = support_offsets.back();
+
+	// Même normalisation que kakeibo.classifier : chaque chiffre sur 9.
+	std::vector<double> x(feature_count);
+	for (size_t i = 0; i < feature_count; ++i)
+		x[i] = features[i] / 9.;
+
+	// Noyau RBF entre l’entrée et chaque vecteur support.
+	std::vector<double> kernel(vector_count);
+	for (size_t v = 0; v < vector_count; ++v) {
+		const double* sv = &support_vectors[v * feature_count];
+		double distance = 0;
+		for (size_t i = 0; i < feature_count; ++i) {
+			double d = x[i] - sv[i];
+			distance += d * d;
+		}
+		kernel[v] = std::exp(-gamma * distance);
+	}
+
+	// Vote un-contre-un. Pour la paire (i, j), les coefficients des vecteurs
+	// de la classe i sont sur la ligne j - 1, et ceux de j sur la ligne i.
+	std::vector<int> votes(class_count);
+	size_t pair = 0;
+	for (size_t i = 0; i < class_count; ++i) {
+		for (size_t j = i + 1; j < class_count; ++j) {
+			double sum = intercepts[pair++];
+			const double* coef_i = &coefficients[(j - 1) * vector_count];
+			const double* coef_j = &coefficients[i * vector_count];
+			for (size_t v = support_offsets[i]; v < support_offsets[i + 1]; ++v)
+				sum += coef_i[v] * kernel[v];
+			for (size_t v = support_offsets[j]; v < support_offsets[j + 1]; ++v)
+				sum += coef_j[v] * kernel[v];
+			++votes[sum > 0 ? i : j];
+		}
+	}
+
+	// En cas d’égalité, libsvm garde la première classe.
+	size_t best = 0;
+	for (size_t i = 1; i < class_count; ++i) {
+		if (votes[i] > votes[best])
+			best = i;
+	}
+	return labels[best];
+}
@@ -22,6 +22,7 @@
 #include <opencv2/imgproc.hpp>
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <optional>
 
@@ -161,29 +162,49 @@ static std::vector<cv::Point> approximate_rectangle(const std::vector<cv::Point>
 }
 
 /**
- * Version configurable de find_receipts.
+ * Trie les reçus de gauche à droite (forte préférence), puis de haut au bas.
+ * On tolère qu’un reçu soit un peu décalé à gauche s’il est bien en-dessous.
  */
-std::vector<quad> find_receipts_ex(cv::Mat source, int saturation_threshold)
+static void sort_receipts(std::vector<quad>& receipts)
+{
+	auto left_of = [](const quad& a, const quad& b) {
+		return a.corners[0].x * 3 + b.corners[0].y < b.corners[0].x * 3 + b.corners[0].y;
+	};
+	std::sort(receipts.begin(), receipts.end(), left_of);
+}
+
+/**
+ * Cherche les reçus dans un masque binaire des pixels susceptibles
+ * d’appartenir à un reçu. source ne sert qu’à l’affichage pour --explain.
+ * scale indique le facteur de réduction de l’image par rapport à la photo,
+ * pour adapter les tailles minimales et le filtrage du bruit. Si stats est
+ * fourni, on y compte les contours trouvés et rejetés pour --profile.
+ */
+static std::vector<quad> find_receipts_in_mask(cv::Mat source, cv::Mat image, int scale = 1, std::array<int, COUNTER_COUNT>* stats = nullptr)
 {
 	// Résultat.
 	std::vector<quad> receipts;
 
-	// Sélectionne uniquement les pixels clairs avec une saturation quasi-nulle.
-	cv::Mat image;
-	cv::cvtColor(source, image, cv::COLOR_BGR2HSV);
-	cv::inRange(image, cv::Scalar(0, 0, 128), cv::Scalar(255, saturation_threshold, 255), image);
-
 	// Opening pour ne pas que le bruit nous génère des contours parasites.
-	cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(9, 9));
-	cv::morphologyEx(image, image, cv::MORPH_OPEN, element);
+	// Le masque est une vue sur un tampon du workspace, d’où BORDER_ISOLATED
+	// pour ne pas lire les pixels du tampon autour.
+	int opening = std::max(3, 9 / scale);
+	cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(opening, opening));
+	cv::morphologyEx(image, image, cv::MORPH_OPEN, element, cv::Point(-1, -1), 1, cv::BORDER_CONSTANT | cv::BORDER_ISOLATED);
 	show("shapes", image);
 
 	cv::Mat drawing;
 	if (explain)
 		drawing = source.clone();
 
-	std::vector<std::vector<cv::Point>> contours;
+	// Appelée depuis les threads de cv::parallel_for_, donc on prend le
+	// workspace du thread courant plutôt que celui de l’appelant.
+	std::vector<std::vector<cv::Point>>& contours = scratch().photo_contours;
 	cv::findContours(image, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+	std::array<int, COUNTER_COUNT> ignored_stats;
+	std::array<int, COUNTER_COUNT>& counts = stats ? *stats : ignored_stats;
+	counts.fill(0);
+	counts[CONTOURS] = contours.size();
         for (size_t i = 0; i < contours.size(); i++) {
 		std::vector<cv::Point> poly = approximate_rectangle(contours[i]);
 		if (explain) {
@@ -194,38 +215,118 @@ std::vector<quad> find_receipts_ex(cv::Mat source, int saturation_threshold)
 		}
 
 		// Traiter uniquement les rectangles;
-		if (poly.size() != 4)
+		if (poly.size() != 4) {
+			++counts[NOT_RECTANGLES];
 			continue;
+		}
 
 		quad q(poly);
 		int w = q.width();
 		int h = q.height();
-		if (w < 400 || h < 300)
-			continue; // Trop petit.
-		if (w > h * 0.8)
+		if (w < 400 / scale || h < 300 / scale) {
+			++counts[TOO_SMALL];
+			continue;
+		}
+		if (w > h * 0.8) {
 			// Trop large par rapport à sa hauteur.
+			++counts[TOO_WIDE];
 			continue;
+		}
 
-		// Élimine un peu de bordure car il s’agit souvent d’ombre.
-		q.shrink(h * 0.005);
+		// Élimine un peu de bordure car il s’agit souvent d’ombre. Sur une
+		// image réduite, refine_receipts le fera en pleine résolution, après
+		// avoir affiné les coins : rétrécir ici les éloignerait des vrais.
+		if (scale == 1)
+			q.shrink(h * 0.005);
 
 		receipts.push_back(q);
 	}
 
 	if (explain)
 		show("contours", drawing);
+	// Le thread d’OpenCV qui nous appelle ne passe pas par release.
+	if (memory_budget) {
+		contours.clear();
+		contours.shrink_to_fit();
+	}
 
-	// Trie les reçus de gauche à droite (forte préférence), puis de haut
-	// au bas. On tolère qu’un reçu soit un peu décalé à gauche s’il est
-	// bien en-dessous.
-	auto left_of = [](const quad& a, const quad& b) {
-		return a.corners[0].x * 3 + b.corners[0].y < b.corners[0].x * 3 + b.corners[0].y;
-	};
-	std::sort(receipts.begin(), receipts.end(), left_of);
-
+	sort_receipts(receipts);
 	return receipts;
 }
 
+/**
+ * Seuils de saturation essayés par find_receipts.
+ */
+static const std::array<int, 3> saturation_thresholds = { 16, 32, 48 };
+
+/**
+ * Limite approximative, en octets, de la mémoire de travail de la détection,
+ * donnée par --max-memory. 0 pour ne pas la limiter.
+ */
+size_t memory_budget = 0;
+
+/**
+ * Conversion HSV d’une image, découpée en bandes horizontales de strip_rows
+ * lignes pour ne jamais avoir toute l’image HSV en mémoire. Quand une seule
+ * bande couvre l’image, elle n’est convertie qu’une fois quel que soit le
+ * nombre de passes. La conversion se faisant pixel par pixel, le découpage ne
+ * change rien au résultat.
+ */
+struct hsv_strips {
+	cv::Mat image;
+	int strip_rows;
+	cv::Mat whole;
+
+	/**
+	 * Appelle f(bande, première ligne) sur chaque bande, dans l’ordre. La
+	 * bande n’est valide que pendant l’appel.
+	 */
+	template<typename F> void for_each(workspace& ws, F f)
+	{
+		if (strip_rows >= image.rows) {
+			if (whole.empty()) {
+				whole = ws.buffer(SLOT_HSV, image.size(), CV_8UC3);
+				cv::cvtColor(image, whole, cv::COLOR_BGR2HSV);
+			}
+			f(whole, 0);
+			return;
+		}
+		for (int top = 0; top < image.rows; top += strip_rows) {
+			cv::Mat source = image.rowRange(top, std::min(top + strip_rows, image.rows));
+			cv::Mat strip = ws.buffer(SLOT_HSV, source.size(), CV_8UC3);
+			cv::cvtColor(source, strip, cv::COLOR_BGR2HSV);
+			f(strip, top);
+		}
+	}
+};
+
+/**
+ * Construit à partir d’une seule conversion HSV le masque de chacun des count
+ * seuils de saturation : un pixel est retenu s’il est clair (V ≥ 128) et que
+ * sa saturation ne dépasse pas le seuil. C’est l’équivalent de cv::inRange
+ * pour chaque seuil. Les plans S et V sont extraits une fois, le masque des
+ * pixels clairs est commun à tous les seuils, et chaque masque ne coûte plus
+ * qu’un seuillage et un et logique, tous vectorisés par OpenCV.
+ */
+static void saturation_masks(hsv_strips& hsv, const int* thresholds, size_t count, cv::Mat* masks, workspace& ws)
+{
+	for (size_t i = 0; i < count; ++i)
+		masks[i] = ws.buffer(workspace_slot(SLOT_MASK + i), hsv.image.size(), CV_8UC1);
+
+	hsv.for_each(ws, [&](cv::Mat strip, int top) {
+		cv::Mat saturation = ws.buffer(SLOT_SATURATION, strip.size(), CV_8UC1);
+		cv::Mat bright = ws.buffer(SLOT_VALUE, strip.size(), CV_8UC1);
+		cv::extractChannel(strip, saturation, 1);
+		cv::extractChannel(strip, bright, 2);
+		cv::threshold(bright, bright, 127, 255, cv::THRESH_BINARY);
+		for (size_t i = 0; i < count; ++i) {
+			cv::Mat rows = masks[i].rowRange(top, top + strip.rows);
+			cv::threshold(saturation, rows, thresholds[i], 255, cv::THRESH_BINARY_INV);
+			cv::bitwise_and(rows, bright, rows);
+		}
+	});
+}
+
 /**
  * Renvoie un score correspondant à la qualité des candidats. La partie entière
  * correspond au nombre d’éléments, et la fraction à la moyenne du sinus des
@@ -250,36 +351,387 @@ static double evaluate_candidate(const std::vector<quad>& candidate)
 }
 
 /**
- * Renvoie la liste des countours des reçus trouvés. On tente plusieurs niveau
- * de saturation car selon que l’image a été prise dans un environnement clair
- * ou un peu ombré, le seuil utile pour avoir les meilleurs résultats varie.
+ * Facteur de réduction de la photo pour la détection des reçus. À 1, on
+ * travaille en pleine résolution. Au-delà, voir refine_corners.
  */
-std::vector<quad> find_receipts(cv::Mat source)
+int detection_scale = 1;
+
+/**
+ * Replace chaque coin d’un reçu détecté sur l’image réduite sur la photo en
+ * pleine résolution. On n’analyse qu’une petite fenêtre autour de chaque coin
+ * estimé, dans laquelle le coin est le pixel du reçu le plus loin dans sa
+ * direction, de la même manière que quad ordonne ses coins. Seule compte la
+ * composante connexe qui contient l’estimation, ou à défaut la plus proche,
+ * pour qu’un reçu voisin entrant dans la fenêtre ne soit pas pris pour un
+ * morceau de celui-ci. Si la fenêtre ne contient aucun pixel du reçu, on garde
+ * l’estimation grossière.
+ *
+ * On la garde aussi si le coin trouvé recule vers l’intérieur du reçu de plus
+ * que l’erreur d’arrondi : le coin est alors caché, par un doigt par exemple,
+ * et l’estimation vient de l’intersection des bords que fait
+ * approximate_rectangle, alors que le pixel le plus loin serait sur le bord
+ * de ce qui le cache.
+ *
+ * Les coins estimés ne sont pas rétrécis, donc la fenêtre n’a à couvrir que
+ * l’erreur de la réduction : un pixel de l’image réduite pour l’arrondi, et
+ * quelques-uns pour l’ouverture et l’approximation du contour.
+ */
+static void refine_corners(cv::Mat source, quad& q, int saturation_threshold, int scale, workspace& ws)
 {
-	std::vector<quad> best_result;
+	static const cv::Point directions[4] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+	int radius = scale + 4 * scale;
+	cv::Rect bounds(0, 0, source.cols, source.rows);
+	cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(9, 9));
+
+	for (size_t i = 0; i < 4; ++i) {
+		cv::Point estimate = q.corners[i] * scale + cv::Point(scale / 2, scale / 2);
+		cv::Rect window = cv::Rect(estimate.x - radius, estimate.y - radius, 2 * radius + 1, 2 * radius + 1) & bounds;
+		q.corners[i] = estimate;
+		if (window.empty())
+			continue;
+
+		cv::Mat hsv = ws.buffer(SLOT_HSV, window.size(), CV_8UC3);
+		cv::Mat mask = ws.buffer(SLOT_CORNER, window.size(), CV_8UC1);
+		cv::cvtColor(source(window), hsv, cv::COLOR_BGR2HSV);
+		cv::inRange(hsv, cv::Scalar(0, 0, 128), cv::Scalar(255, saturation_threshold, 255), mask);
+		cv::morphologyEx(mask, mask, cv::MORPH_OPEN, element, cv::Point(-1, -1), 1, cv::BORDER_CONSTANT | cv::BORDER_ISOLATED);
+		cv::Mat labels = ws.buffer(SLOT_CORNER_LABELS, window.size(), CV_32S);
+		cv::connectedComponents(mask, labels, 8, CV_32S);
+
+		cv::Point center = estimate - window.tl();
+		int label = 0;
+		int best_distance = 0;
+		for (int y = 0; y < labels.rows; ++y) {
+			const int* row = labels.ptr<int>(y);
+			for (int x = 0; x < labels.cols; ++x) {
+				int distance = (x - center.x) * (x - center.x) + (y - center.y) * (y - center.y);
+				if (row[x] && (!label || distance < best_distance)) {
+					label = row[x];
+					best_distance = distance;
+				}
+			}
+		}
+		if (!label)
+			continue;
+
+		cv::Point direction = directions[i];
+		std::optional<cv::Point> corner;
+		int best_score = 0;
+		for (int y = 0; y < labels.rows; ++y) {
+			const int* row = labels.ptr<int>(y);
+			for (int x = 0; x < labels.cols; ++x) {
+				int score = direction.x * x + direction.y * y;
+				if (row[x] == label && (!corner || score > best_score)) {
+					corner = cv::Point(x, y);
+					best_score = score;
+				}
+			}
+		}
+
+		cv::Point shift = *corner - center;
+		if (direction.x * shift.x < -scale || direction.y * shift.y < -scale)
+			continue;
+		q.corners[i] = *corner + window.tl();
+	}
+}
+
+/** Stratégie de choix du seuil de saturation, choisie par --threshold. */
+threshold_strategy saturation_strategy = THRESHOLD_SEARCH;
+
+/**
+ * En dessous de cette moyenne des sinus des angles, les reçus trouvés avec le
+ * seuil de l’histogramme sont jugés douteux et on se rabat sur la recherche.
+ */
+static const double minimum_squareness = 0.97;
+
+/**
+ * Choisit le seuil de saturation d’après l’histogramme de la photo. Parmi les
+ * pixels clairs, les reçus forment une population de saturation quasi-nulle,
+ * que la méthode d’Otsu sépare du reste en maximisant la variance entre les
+ * deux classes. Le seuil est borné pour rester dans la plage où la recherche
+ * exhaustive trouve ses résultats.
+ */
+static int histogram_threshold(hsv_strips& hsv, workspace& ws)
+{
+	std::array<uint32_t, 256> histogram {};
+	hsv.for_each(ws, [&](cv::Mat strip, int) {
+		for (int y = 0; y < strip.rows; ++y) {
+			const uchar* pixel = strip.ptr<uchar>(y);
+			for (int x = 0; x < strip.cols; ++x, pixel += 3) {
+				if (pixel[2] >= 128)
+					++histogram[pixel[1]];
+			}
+		}
+	});
+
+	double total = 0, total_sum = 0;
+	for (int s = 0; s < 256; ++s) {
+		total += histogram[s];
+		total_sum += double(s) * histogram[s];
+	}
+
+	int threshold = saturation_thresholds[1];
+	double low_weight = 0, low_sum = 0, best_variance = 0;
+	for (int s = 0; s < 256; ++s) {
+		low_weight += histogram[s];
+		low_sum += double(s) * histogram[s];
+		double high_weight = total - low_weight;
+		if (low_weight == 0)
+			continue;
+		if (high_weight == 0)
+			break;
+		double difference = low_sum / low_weight - (total_sum - low_sum) / high_weight;
+		double variance = low_weight * high_weight * difference * difference;
+		if (variance > best_variance) {
+			best_variance = variance;
+			threshold = s;
+		}
+	}
+	return std::clamp(threshold, 8, 64);
+}
+
+/**
+ * Reçus trouvés avec un seuil de saturation, et leur évaluation.
+ */
+struct threshold_candidate {
+	int threshold;
+	std::vector<quad> receipts;
+	std::array<int, COUNTER_COUNT> stats;
+	double score;
+};
+
+/** Cherche et évalue les reçus du masque d’un seuil de saturation. */
+static void evaluate_threshold(threshold_candidate& candidate, int threshold, cv::Mat image, cv::Mat mask, int scale)
+{
+	candidate.threshold = threshold;
+	candidate.receipts = find_receipts_in_mask(image, mask, scale, &candidate.stats);
+	candidate.score = evaluate_candidate(candidate.receipts);
+}
+
+/**
+ * Octets de travail par pixel de chaque masque évalué : le masque lui-même, la
+ * copie qu’en fait l’ouverture, et la copie bordée de findContours.
+ */
+static const size_t mask_cost = 3;
+
+/** Octets par pixel d’une bande de la conversion HSV, puis de ses plans S et V. */
+static const size_t strip_cost = 5;
+
+/** Hauteur minimale des bandes de la conversion HSV avec --max-memory. */
+static const int minimum_strip_rows = 16;
+
+/** Réduction maximale de l’image pour respecter memory_budget. */
+static const int maximum_budget_factor = 16;
+
+/**
+ * Renvoie le facteur, puissance de 2, dont réduire une image de la taille
+ * donnée pour que la détection tienne dans memory_budget : un masque et la
+ * plus petite bande HSV, sans quoi aucune détection n’est possible.
+ */
+static int budget_factor(cv::Size size)
+{
+	int factor = 1;
+	while (factor < maximum_budget_factor) {
+		size_t cols = size.width / factor;
+		size_t rows = size.height / factor;
+		if (mask_cost * cols * rows + strip_cost * cols * minimum_strip_rows <= memory_budget)
+			break;
+		factor *= 2;
+	}
+	return factor;
+}
+
+/**
+ * Cherche les reçus avec chaque seuil de saturation_thresholds. Les masques
+ * sont calculés en une seule passe pour tous les seuils, puis chaque candidat
+ * est évalué en parallèle. Avec --explain, on reste séquentiel pour que
+ * l’affichage se fasse dans l’ordre.
+ *
+ * Si les masques ne tiennent pas ensemble dans memory_budget, chaque seuil
+ * est évalué à son tour avec un seul masque, au prix d’une conversion HSV par
+ * seuil. Les candidats sont les mêmes.
+ */
+static std::array<threshold_candidate, 3> search_thresholds(cv::Mat image, hsv_strips& hsv, int scale, bool all_masks, workspace& ws)
+{
+	std::array<threshold_candidate, 3> candidates;
+	if (!all_masks) {
+		for (size_t i = 0; i < candidates.size(); ++i) {
+			cv::Mat mask;
+			saturation_masks(hsv, &saturation_thresholds[i], 1, &mask, ws);
+			evaluate_threshold(candidates[i], saturation_thresholds[i], image, mask, scale);
+		}
+		return candidates;
+	}
+
+	std::array<cv::Mat, 3> masks;
+	saturation_masks(hsv, saturation_thresholds.data(), masks.size(), masks.data(), ws);
+	auto find_candidates = [&](const cv::Range& range) {
+		for (int i = range.start; i < range.end; ++i)
+			evaluate_threshold(candidates[i], saturation_thresholds[i], image, masks[i], scale);
+	};
+	if (explain)
+		find_candidates(cv::Range(0, masks.size()));
+	else
+		cv::parallel_for_(cv::Range(0, masks.size()), find_candidates);
+	return candidates;
+}
+
+/**
+ * Cherche les reçus d’une image, réduite scale fois par rapport à la photo.
+ * Selon que l’image a été prise dans un environnement clair ou un peu ombré,
+ * le seuil de saturation utile pour avoir les meilleurs résultats varie.
+ *
+ * Par défaut, on tente plusieurs seuils et on garde les reçus les mieux
+ * notés. Avec THRESHOLD_HISTOGRAM, on ne tente que le seuil choisi par
+ * histogram_threshold, et on ne se rabat sur la recherche que si le résultat
+ * est douteux : aucun reçu, ou des angles loin d’être droits. Le seuil retenu
+ * et le nombre de masques évalués sont comptés dans le profil.
+ *
+ * Avec memory_budget, la conversion HSV se fait par bandes, et les masques de
+ * la recherche sont évalués un par un s’ils ne tiennent pas ensemble. Le
+ * résultat est identique, seuls la mémoire utilisée et le temps changent. Si
+ * même un seul masque ne tient pas, l’image est d’abord réduite encore, comme
+ * avec un --detect-scale plus grand, et le résultat change alors.
+ *
+ * Les coins trouvés sont dans le repère de l’image réduite, et doivent passer
+ * par refine_receipts avant de servir à cut_receipt. Si scale dépasse 1, leur
+ * bordure n’est pas encore retirée.
+ */
+receipt_detection detect_receipts(cv::Mat image, int scale)
+{
+	stage_timer timer(STAGE_DETECT);
+	workspace& ws = scratch();
+
+	if (memory_budget) {
+		if (int factor = budget_factor(image.size()); factor > 1) {
+			cv::Mat reduced = ws.buffer(SLOT_REDUCED, cv::Size(image.cols / factor, image.rows / factor), image.type());
+			cv::resize(image, reduced, reduced.size(), 0, 0, cv::INTER_AREA);
+			image = reduced;
+			scale *= factor;
+		}
+	}
+
+	size_t pixels = image.total();
+	size_t search_size = saturation_thresholds.size() * mask_cost * pixels;
+	bool all_masks = memory_budget == 0 || search_size <= memory_budget / 2;
+	hsv_strips hsv { image, image.rows, {} };
+	if (memory_budget) {
+		size_t masks_size = all_masks ? search_size : mask_cost * pixels;
+		size_t left = memory_budget > masks_size ? memory_budget - masks_size : 0;
+		size_t rows = left / (strip_cost * size_t(image.cols));
+		hsv.strip_rows = int(std::min<size_t>(std::max<size_t>(rows, minimum_strip_rows), image.rows));
+	}
+
+	std::vector<threshold_candidate> candidates;
+	if (saturation_strategy == THRESHOLD_HISTOGRAM) {
+		int threshold = histogram_threshold(hsv, ws);
+		cv::Mat mask;
+		saturation_masks(hsv, &threshold, 1, &mask, ws);
+		evaluate_threshold(candidates.emplace_back(), threshold, image, mask, scale);
+	}
+	if (candidates.empty() || !(candidates[0].score - candidates[0].receipts.size() >= minimum_squareness)) {
+		for (threshold_candidate& candidate : search_thresholds(image, hsv, scale, all_masks, ws))
+			candidates.push_back(std::move(candidate));
+	}
+	count(DETECTION_PASSES, candidates.size());
+
+	// À score égal, le premier candidat l’emporte : le seuil de
+	// l’histogramme, puis le seuil le plus bas.
+	size_t best_index = 0;
 	double best_score = 0;
-	for (int threshold = 16; threshold <= 48; threshold += 16) {
-		std::vector<quad> candidate = find_receipts_ex(source, threshold);
-		double score = evaluate_candidate(candidate);
-		if (score > best_score) {
-			best_result = std::move(candidate);
-			best_score = score;
+	for (size_t i = 0; i < candidates.size(); ++i) {
+		if (candidates[i].score > best_score) {
+			best_index = i;
+			best_score = candidates[i].score;
 		}
 	}
-	return best_result;
+	threshold_candidate& best = candidates[best_index];
+	// Seul le seuil retenu compte pour le profil.
+	for (profile_counter counter : { CONTOURS, NOT_RECTANGLES, TOO_SMALL, TOO_WIDE })
+		count(counter, best.stats[counter]);
+	count(SATURATION_THRESHOLD, best.threshold);
+
+	receipt_detection detection { {}, scale, best.threshold };
+	if (best_score == 0)
+		return detection;
+	detection.receipts = std::move(best.receipts);
+	count(RECEIPTS, detection.receipts.size());
+	return detection;
+}
+
+/**
+ * Ramène les reçus détectés par detect_receipts sur la photo en pleine
+ * résolution. Si la détection s’est faite sur une image réduite, seuls les
+ * coins des reçus sont affinés en pleine résolution. Le coût dépend alors du
+ * nombre de reçus plutôt que du nombre de pixels.
+ */
+std::vector<quad> refine_receipts(cv::Mat source, const receipt_detection& detection)
+{
+	std::vector<quad> receipts = detection.receipts;
+	if (detection.scale <= 1)
+		return receipts;
+
+	stage_timer timer(STAGE_DETECT);
+	workspace& ws = scratch();
+	for (quad& q : receipts) {
+		refine_corners(source, q, detection.saturation_threshold, detection.scale, ws);
+		// Même bordure que find_receipts_in_mask en pleine résolution.
+		q.shrink(q.height() * 0.005);
+	}
+	sort_receipts(receipts);
+	return receipts;
+}
+
+/**
+ * Renvoie la liste des countours des reçus trouvés sur la photo.
+ *
+ * Si detection_scale est supérieur à 1, la détection se fait sur la photo
+ * réduite d’autant, puis seuls les coins des reçus retenus sont affinés en
+ * pleine résolution.
+ */
+std::vector<quad> find_receipts(cv::Mat source)
+{
+	int scale = std::max(1, detection_scale);
+	cv::Mat image = source;
+	if (scale > 1) {
+		stage_timer timer(STAGE_DETECT);
+		// Même taille que celle que calcule cv::resize à partir du facteur,
+		// que l’on garde pour obtenir exactement la même interpolation.
+		cv::Size size(cv::saturate_cast<int>(source.cols * (1. / scale)), cv::saturate_cast<int>(source.rows * (1. / scale)));
+		image = scratch().buffer(SLOT_SMALL, size, source.type());
+		cv::resize(source, image, cv::Size(), 1. / scale, 1. / scale, cv::INTER_AREA);
+	}
+	return refine_receipts(source, detect_receipts(image, scale));
 }
 
 /**
  * Reçoit une image et un des countours trouvés par find_receipts, puis découpe
  * le reçu en question. L’image est recadrée et sa perspective corrigée pour
  * faire 600 px de large, soit une résolution d’environ 10 px / mm.
+ *
+ * Avec red_only, seul le canal rouge est découpé, le seul qu’utilise
+ * binarize. On extrait le rouge du rectangle englobant le reçu, avec une
+ * marge pour l’interpolation, et on ne transforme que ce plan : le résultat
+ * est le canal rouge du découpage en couleur, aux arrondis près, pour un
+ * tiers du calcul et de la mémoire.
  */
-cv::Mat cut_receipt(cv::Mat source, quad q)
+cv::Mat cut_receipt(cv::Mat source, quad q, bool red_only)
 {
+	stage_timer timer(STAGE_WARP);
 	// Conversion du contour en 4 Point2f pour getPerspectiveTransform.
 	std::vector<cv::Point2f> old_rect;
 	std::transform(q.corners.begin(), q.corners.end(), std::back_inserter(old_rect), [] (cv::Point p) { return p; });
 
+	if (red_only && source.channels() == 3) {
+		cv::Rect bounds = cv::boundingRect(std::vector<cv::Point>(q.corners.begin(), q.corners.end()));
+		bounds = cv::Rect(bounds.x - 2, bounds.y - 2, bounds.width + 4, bounds.height + 4) & cv::Rect(0, 0, source.cols, source.rows);
+		cv::Mat red;
+		cv::extractChannel(source(bounds), red, 2);
+		source = red;
+		for (cv::Point2f& corner : old_rect)
+			corner -= cv::Point2f(bounds.tl());
+	}
+
 	// Calcul de la taille de l’image extraite. On force largeur et préserve le ratio.
 	float new_width = 600;
 	float new_height = q.height() * new_width / q.width();
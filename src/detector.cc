@@ -9,7 +9,8 @@
  * Ces images groupées en dossier, --compile permet de générer un CSV servant à
  * l’apprentissage. Enfin, --scan sort sous forme textuelle les features de
  * toutes les lettres trouvées. Chaque ligne de texte est une ligne du reçu, et
- * chaque mot (features) est une lettre.
+ * chaque mot (features) est une lettre. Avec --binary, ces mêmes features sont
+ * écrites en trames binaires, à raison d’un octet par feature.
  *
  * Toute la partie apprentissage machine est hors de ce module. On s’occupe ici
  * uniquement du découpage des lettres et le l’extraction des features.
@@ -20,7 +21,13 @@
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 
+#include <algorithm>
+#include <climits>
+#include <cmath>
 #include <filesystem>
+#include <map>
+#include <numeric>
+#include <unordered_map>
 
 /**
  * Représente une ligne de texte. box est la bounding box sur l’image d’entrée.
@@ -48,24 +55,26 @@ void text_line::sort()
  * Reçoit une image binaire et le contour de la ligne à extraire.
  * Extrait les lettres de la ligne et construit l’objet text_line.
  */
-static text_line extract_text_line(cv::Mat binary, const std::vector<cv::Point>& contour)
+static text_line extract_text_line(cv::Mat binary, const std::vector<cv::Point>& contour, workspace& ws)
 {
-	std::vector<cv::Point> hull;
+	std::vector<cv::Point>& hull = ws.hull;
 	cv::convexHull(contour, hull);
 	cv::Rect line_box = cv::boundingRect(hull);
-	if (line_box.area() < 50) // Ignore le bruit.
+	if (line_box.area() < 50) { // Ignore le bruit.
+		count(NOISE_LINES);
 		return {};
+	}
 
 	cv::Size dilatation { /* horizontal */ 1, /* vertical */ 19 };
-	cv::Mat extract = cv::Mat(
-		line_box.height + 2 * dilatation.height,
+	cv::Mat extract = ws.buffer(SLOT_LINE, cv::Size(
 		line_box.width + 2 * dilatation.width,
-		binary.type(),
-		cv::Scalar(0)
-	);
+		line_box.height + 2 * dilatation.height
+	), binary.type());
+	extract.setTo(cv::Scalar(0));
 
 	cv::Mat input_roi = binary(line_box);
-	cv::Mat input_mask = cv::Mat(line_box.height, line_box.width, CV_8UC1, cv::Scalar(0));
+	cv::Mat input_mask = ws.buffer(SLOT_LINE_MASK, line_box.size(), CV_8UC1);
+	input_mask.setTo(cv::Scalar(0));
 	for (cv::Point& p : hull) p -= line_box.tl();
 	cv::fillConvexPoly(input_mask, hull, cv::Scalar(255));
 
@@ -76,17 +85,21 @@ static text_line extract_text_line(cv::Mat binary, const std::vector<cv::Point>&
 	cv::Mat output_roi = extract(output_box);
 	input_roi.copyTo(output_roi, input_mask);
 
-	// La dilatation verticale permet de rassembler les contours d’une même lettre.
+	// La dilatation verticale permet de rassembler les contours d’une même
+	// lettre. extract est une vue sur un tampon plus grand, d’où
+	// BORDER_ISOLATED pour ne pas lire les pixels du tampon autour.
 	cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(dilatation.width, dilatation.height));
-	cv::morphologyEx(extract, extract, cv::MORPH_CLOSE, element);
+	cv::morphologyEx(extract, extract, cv::MORPH_CLOSE, element, cv::Point(-1, -1), 1, cv::BORDER_CONSTANT | cv::BORDER_ISOLATED);
 
 	std::vector<cv::Rect> letters;
-	std::vector<std::vector<cv::Point>> contours;
+	std::vector<std::vector<cv::Point>>& contours = ws.letter_contours;
 	cv::findContours(extract, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
 	for (auto& contour : contours) {
 		cv::Rect letter = cv::boundingRect(contour);
-		if (letter.width < 10 && letter.height < 10) // Ignore le bruit.
+		if (letter.width < 10 && letter.height < 10) { // Ignore le bruit.
+			count(NOISE_LETTERS);
 			continue;
+		}
 
 		letter.x += line_box.x - dilatation.width;
 		letter.y += line_box.y - dilatation.height;
@@ -96,34 +109,358 @@ static text_line extract_text_line(cv::Mat binary, const std::vector<cv::Point>&
 	return text_line { line_box, letters };
 }
 
+/**
+ * Ajoute une ligne extraite par extract_text_line à lines, sauf si elle est
+ * vide ou vraisemblablement du bruit.
+ */
+static void keep_text_line(std::vector<text_line>& lines, text_line&& line)
+{
+	if (line.letters.empty())
+		return;
+
+	// Les lignes avec une seule lettre sont vraisemblablement du bruit, ou
+	// un morceau de lettre qui n’a pas été attrapé dans le contour de la
+	// ligne.
+	if (line.letters.size() == 1 && line.letters[0].area() < 200) {
+		count(NOISE_LINES);
+		return;
+	}
+
+	lines.push_back(std::move(line));
+}
+
 /**
  * Reçoit une image binaire et détecte les lignes de texte.
  * Renvoie la liste des text_line trouvés.
  */
-static std::vector<text_line> extract_text_lines(cv::Mat binary)
+static std::vector<text_line> extract_text_lines(cv::Mat binary, workspace& ws)
 {
 	// La dilatation horizontale permet de rassembler les lignes dans un même contour.
-	cv::Mat dilated;
+	cv::Mat dilated = ws.buffer(SLOT_LINES, binary.size(), binary.type());
 	cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(19, 5));
 	cv::morphologyEx(binary, dilated, cv::MORPH_CLOSE, element);
 
 	std::vector<text_line> lines;
-	std::vector<std::vector<cv::Point>> contours;
+	std::vector<std::vector<cv::Point>>& contours = ws.line_contours;
 	cv::findContours(dilated, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
-	for (auto& contour : contours) {
-		text_line line = extract_text_line(binary, contour);
-		if (line.letters.empty())
+	for (auto& contour : contours)
+		keep_text_line(lines, extract_text_line(binary, contour, ws));
+
+	return lines;
+}
+
+/** Moteur de segmentation des lignes et des lettres, choisi par --segment. */
+segmentation_engine segmentation = SEGMENT_CONTOURS;
+
+/**
+ * Recherche de la racine d’un ensemble disjoint, avec compression de chemin.
+ */
+static int find_root(std::vector<int>& parents, int i)
+{
+	while (parents[i] != i)
+		i = parents[i] = parents[parents[i]];
+	return i;
+}
+
+/**
+ * Réunit deux ensembles disjoints. La plus petite racine l’emporte, pour que
+ * le résultat ne dépende pas de l’ordre des unions.
+ */
+static void unite(std::vector<int>& parents, int a, int b)
+{
+	a = find_root(parents, a);
+	b = find_root(parents, b);
+	if (a != b)
+		parents[std::max(a, b)] = std::min(a, b);
+}
+
+/**
+ * Nombre de pixels vides entre les intervalles [a, a + la[ et [b, b + lb[.
+ * Négatif s’ils se chevauchent.
+ */
+static int interval_gap(int a, int la, int b, int lb)
+{
+	return std::max(a, b) - std::min(a + la, b + lb);
+}
+
+/**
+ * Variante de extract_text_lines qui n’étiquette l’image qu’une seule fois.
+ *
+ * Chaque composante connexe est réduite à sa bounding box. Les boîtes sont
+ * rangées dans une grille pour ne comparer que des voisines, puis regroupées
+ * en lignes et en lettres en imitant les fermetures de l’autre moteur : une
+ * ligne réunit les boîtes à moins de 19 px horizontalement et 5 px
+ * verticalement, et une lettre réunit les morceaux d’une même ligne qui se
+ * superposent horizontalement et sont à moins de 19 px verticalement, comme les
+ * deux parties d’un « i ».
+ */
+static std::vector<text_line> extract_text_components(cv::Mat binary, workspace& ws)
+{
+	static const cv::Size line_closing(19, 5);
+	static const int letter_closing = 19;
+	static const int cell_size = 32;
+
+	cv::Mat labels = ws.buffer(SLOT_LABELS, binary.size(), CV_32S);
+	int label_count = cv::connectedComponentsWithStats(binary, labels, ws.component_stats, ws.component_centroids, 8, CV_32S);
+
+	// L’étiquette 0 est le fond.
+	std::vector<cv::Rect>& boxes = ws.components;
+	boxes.clear();
+	for (int i = 1; i < label_count; ++i) {
+		const int* stats = ws.component_stats.ptr<int>(i);
+		boxes.emplace_back(stats[cv::CC_STAT_LEFT], stats[cv::CC_STAT_TOP], stats[cv::CC_STAT_WIDTH], stats[cv::CC_STAT_HEIGHT]);
+	}
+	int box_count = boxes.size();
+
+	// Index spatial : chaque case de la grille liste les boîtes qui la
+	// touchent. On ne réduit jamais la grille pour garder les capacités.
+	int columns = (binary.cols + cell_size - 1) / cell_size;
+	int rows = (binary.rows + cell_size - 1) / cell_size;
+	if (ws.cells.size() < size_t(columns * rows))
+		ws.cells.resize(columns * rows);
+	for (int i = 0; i < columns * rows; ++i)
+		ws.cells[i].clear();
+	for (int i = 0; i < box_count; ++i) {
+		const cv::Rect& box = boxes[i];
+		for (int y = box.y / cell_size; y <= (box.y + box.height - 1) / cell_size; ++y) {
+			for (int x = box.x / cell_size; x <= (box.x + box.width - 1) / cell_size; ++x)
+				ws.cells[y * columns + x].push_back(i);
+		}
+	}
+
+	// Appelle link pour chaque boîte dans les cases touchées par la boîte i
+	// élargie de margin. Une même voisine peut être vue plusieurs fois.
+	auto for_each_neighbour = [&](int i, cv::Size margin, auto link) {
+		const cv::Rect& box = boxes[i];
+		int top = std::max(0, box.y - margin.height) / cell_size;
+		int bottom = std::min(binary.rows - 1, box.y + box.height - 1 + margin.height) / cell_size;
+		int left = std::max(0, box.x - margin.width) / cell_size;
+		int right = std::min(binary.cols - 1, box.x + box.width - 1 + margin.width) / cell_size;
+		for (int y = top; y <= bottom; ++y) {
+			for (int x = left; x <= right; ++x) {
+				for (int j : ws.cells[y * columns + x]) {
+					if (j != i)
+						link(j);
+				}
+			}
+		}
+	};
+
+	std::vector<int>& line_parents = ws.line_parents;
+	line_parents.resize(box_count);
+	std::iota(line_parents.begin(), line_parents.end(), 0);
+	for (int i = 0; i < box_count; ++i) {
+		const cv::Rect& a = boxes[i];
+		for_each_neighbour(i, line_closing, [&](int j) {
+			const cv::Rect& b = boxes[j];
+			if (interval_gap(a.x, a.width, b.x, b.width) < line_closing.width
+				&& interval_gap(a.y, a.height, b.y, b.height) < line_closing.height)
+				unite(line_parents, i, j);
+		});
+	}
+
+	std::vector<int>& glyph_parents = ws.glyph_parents;
+	glyph_parents.resize(box_count);
+	std::iota(glyph_parents.begin(), glyph_parents.end(), 0);
+	for (int i = 0; i < box_count; ++i) {
+		const cv::Rect& a = boxes[i];
+		int line = find_root(line_parents, i);
+		for_each_neighbour(i, cv::Size(0, letter_closing), [&](int j) {
+			const cv::Rect& b = boxes[j];
+			if (interval_gap(a.x, a.width, b.x, b.width) < 0
+				&& interval_gap(a.y, a.height, b.y, b.height) < letter_closing
+				&& find_root(line_parents, j) == line)
+				unite(glyph_parents, i, j);
+		});
+	}
+
+	// Construit les lignes, puis les lettres à partir des racines.
+	std::vector<text_line> lines;
+	std::vector<int>& line_indices = ws.line_indices;
+	line_indices.assign(box_count, -1);
+	std::vector<cv::Rect>& glyphs = ws.glyphs;
+	glyphs.assign(boxes.begin(), boxes.end());
+	for (int i = 0; i < box_count; ++i) {
+		int line = find_root(line_parents, i);
+		if (line_indices[line] < 0) {
+			line_indices[line] = lines.size();
+			lines.push_back(text_line { boxes[i], {} });
+		} else
+			lines[line_indices[line]].box |= boxes[i];
+
+		int glyph = find_root(glyph_parents, i);
+		if (glyph != i)
+			glyphs[glyph] |= boxes[i];
+	}
+	for (int i = 0; i < box_count; ++i) {
+		if (find_root(glyph_parents, i) != i)
+			continue;
+		text_line& line = lines[line_indices[find_root(line_parents, i)]];
+		if (line.box.area() < 50)
+			continue;
+		const cv::Rect& letter = glyphs[i];
+		if (letter.width < 10 && letter.height < 10) { // Ignore le bruit.
+			count(NOISE_LETTERS);
+			continue;
+		}
+		line.letters.push_back(letter);
+	}
+
+	// Mêmes filtres que extract_text_line et extract_text_lines.
+	auto is_noise = [](const text_line& line) {
+		if (line.box.area() < 50 || (line.letters.size() == 1 && line.letters[0].area() < 200)) {
+			count(NOISE_LINES);
+			return true;
+		}
+		return line.letters.empty();
+	};
+	lines.erase(std::remove_if(lines.begin(), lines.end(), is_noise), lines.end());
+	return lines;
+}
+
+/**
+ * Découpe un profil en bandes : les suites d’indices où profile est non nul,
+ * réunies quand moins de min_gap indices vides les séparent.
+ */
+static void find_bands(const int* profile, int size, int min_gap, std::vector<cv::Range>& bands)
+{
+	bands.clear();
+	for (int i = 0; i < size; ++i) {
+		if (!profile[i])
 			continue;
+		if (!bands.empty() && i - bands.back().end < min_gap)
+			bands.back().end = i + 1;
+		else
+			bands.emplace_back(i, i + 1);
+	}
+}
+
+/** Largeur des tranches verticales servant à estimer la pente d’une bande. */
+static const int strip_width = 32;
+
+/**
+ * Réestime la pente d’une bande qui semble penchée, et la redécoupe en lignes
+ * de travers. Chaque ligne est ajoutée à polygons sous forme de
+ * parallélogramme, prêt pour extract_text_line.
+ *
+ * La bande est coupée en tranches verticales. La pente est la droite des
+ * moindres carrés passant par le centre de gravité de l’encre de chaque
+ * tranche. Le profil de chaque tranche est alors décalé selon la pente, et la
+ * somme de ces profils redressés est redécoupée en bandes. Renvoie faux si la
+ * pente est négligeable, auquel cas la bande est laissée telle quelle.
+ */
+static bool split_slanted_band(cv::Mat binary, cv::Range band, int left, int right, int line_height, workspace& ws, std::vector<std::vector<cv::Point>>& polygons)
+{
+	int height = band.size();
+	int strip_count = (right - left + strip_width - 1) / strip_width;
+	ws.strip_profiles.resize(strip_count * height);
+
+	double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+	for (int k = 0; k < strip_count; ++k) {
+		int x = left + k * strip_width;
+		int width = std::min(strip_width, right - x);
+		int* profile = &ws.strip_profiles[k * height];
+		cv::Mat profile_header(height, 1, CV_32S, profile);
+		cv::reduce(binary(band, cv::Range(x, x + width)), profile_header, 1, cv::REDUCE_SUM, CV_32S);
 
-		// Les lignes avec une seule lettre sont vraisemblablement du
-		// bruit, ou un morceau de lettre qui n’a pas été attrapé dans
-		// le contour de la ligne.
-		if (line.letters.size() == 1 && line.letters[0].area() < 200)
+		double mass = 0, moment = 0;
+		for (int r = 0; r < height; ++r) {
+			mass += profile[r];
+			moment += double(profile[r]) * r;
+		}
+		if (mass == 0)
 			continue;
+		double cx = x + width / 2.;
+		double cy = moment / mass;
+		n += 1;
+		sx += cx;
+		sy += cy;
+		sxx += cx * cx;
+		sxy += cx * cy;
+	}
+	double denominator = n * sxx - sx * sx;
+	if (n < 2 || denominator == 0)
+		return false;
+	double slope = (n * sxy - sx * sy) / denominator;
+	if (std::abs(slope) * (right - left) < line_height / 2.)
+		return false;
+
+	// Profil redressé sur la verticale du centre de la bande, x0.
+	double x0 = (left + right) / 2.;
+	int margin = std::ceil(std::abs(slope) * (right - left) / 2) + 1;
+	std::vector<int>& deskewed = ws.deskewed_profile;
+	deskewed.assign(height + 2 * margin, 0);
+	for (int k = 0; k < strip_count; ++k) {
+		int x = left + k * strip_width;
+		int width = std::min(strip_width, right - x);
+		int shift = cvRound(slope * (x + width / 2. - x0));
+		const int* profile = &ws.strip_profiles[k * height];
+		for (int r = 0; r < height; ++r)
+			deskewed[r - shift + margin] += profile[r];
+	}
 
-		lines.push_back(line);
+	std::vector<cv::Range>& lines = ws.sub_bands;
+	find_bands(deskewed.data(), deskewed.size(), 5, lines);
+	auto corner = [&](int x, int u) {
+		int y = cvRound(u + slope * (x - x0));
+		return cv::Point(x, std::clamp(y, 0, binary.rows - 1));
+	};
+	for (const cv::Range& line : lines) {
+		int top = band.start + line.start - margin;
+		int bottom = band.start + line.end - margin - 1;
+		polygons.push_back({ corner(left, top), corner(right - 1, top), corner(right - 1, bottom), corner(left, bottom) });
 	}
+	return true;
+}
+
+/**
+ * Variante de extract_text_lines qui trouve les lignes par projection. Un reçu
+ * découpé est à peu près droit, donc une ligne de texte est une bande de
+ * lignes de pixels contenant de l’encre. Les sommes de chaque ligne de pixels
+ * sont calculées par cv::reduce, vectorisé, et les bandes séparées de moins de
+ * 5 px sont réunies, comme par la fermeture de extract_text_lines.
+ *
+ * Une bande nettement plus haute que la hauteur médiane est probablement faite
+ * de lignes de travers qui se chevauchent : seule celle-ci voit sa pente
+ * réestimée par split_slanted_band. Chaque ligne est ensuite confiée à
+ * extract_text_line, comme un contour.
+ */
+static std::vector<text_line> extract_text_projections(cv::Mat binary, workspace& ws)
+{
+	ws.row_profile.resize(binary.rows);
+	cv::Mat rows(binary.rows, 1, CV_32S, ws.row_profile.data());
+	cv::reduce(binary, rows, 1, cv::REDUCE_SUM, CV_32S);
+	std::vector<cv::Range>& bands = ws.bands;
+	find_bands(ws.row_profile.data(), binary.rows, 5, bands);
+	if (bands.empty())
+		return {};
+
+	std::vector<int>& heights = ws.band_heights;
+	heights.clear();
+	for (const cv::Range& band : bands)
+		heights.push_back(band.size());
+	std::nth_element(heights.begin(), heights.begin() + heights.size() / 2, heights.end());
+	int line_height = heights[heights.size() / 2];
+
+	std::vector<text_line> lines;
+	std::vector<std::vector<cv::Point>>& polygons = ws.line_contours;
+	ws.column_profile.resize(binary.cols);
+	cv::Mat columns(1, binary.cols, CV_8U, ws.column_profile.data());
+	for (const cv::Range& band : bands) {
+		// Étendue horizontale de l’encre dans la bande.
+		cv::reduce(binary.rowRange(band.start, band.end), columns, 0, cv::REDUCE_MAX);
+		const std::vector<uchar>& ink = ws.column_profile;
+		int left = std::find_if(ink.begin(), ink.end(), [](uchar v) { return v != 0; }) - ink.begin();
+		int right = ink.rend() - std::find_if(ink.rbegin(), ink.rend(), [](uchar v) { return v != 0; });
 
+		polygons.clear();
+		if (band.size() <= line_height * 3 / 2 || !split_slanted_band(binary, band, left, right, line_height, ws, polygons)) {
+			int bottom = band.end - 1;
+			polygons.push_back({ { left, band.start }, { right - 1, band.start }, { right - 1, bottom }, { left, bottom } });
+		}
+		for (const std::vector<cv::Point>& polygon : polygons)
+			keep_text_line(lines, extract_text_line(binary, polygon, ws));
+	}
 	return lines;
 }
 
@@ -190,9 +527,10 @@ static void compact_lines(std::vector<text_line>& lines)
 	text_line* accumulator = &compacted_lines.emplace_back(*it++);
 	for (; it != lines.end(); ++it) {
 		int overlap = vertical_overlap(*accumulator, *it);
-		if (overlap > accumulator->box.height / 2 && overlap > it->box.height / 2)
+		if (overlap > accumulator->box.height / 2 && overlap > it->box.height / 2) {
 			merge_text_lines(*accumulator, *it);
-		else
+			count(MERGED_LINES);
+		} else
 			accumulator = &compacted_lines.emplace_back(*it);
 	}
 	lines = std::move(compacted_lines);
@@ -200,11 +538,17 @@ static void compact_lines(std::vector<text_line>& lines)
 
 static cv::Mat binarize(cv::Mat color)
 {
+	stage_timer timer(STAGE_BINARIZE);
 	// Extrait le rouge pour rendre les tampons moins visibles. Les tickets
-	// sont monochromes, donc tous les canaux sont plus ou moins égaux.
+	// sont monochromes, donc tous les canaux sont plus ou moins égaux. Une
+	// image à un seul canal est déjà le rouge, découpé par cut_receipt.
 	cv::Mat binary;
-	cv::extractChannel(color, binary, 2); // Canal rouge.
-	cv::bitwise_not(binary, binary); // Blanc sur noir.
+	if (color.channels() == 1) {
+		cv::bitwise_not(color, binary); // Blanc sur noir.
+	} else {
+		cv::extractChannel(color, binary, 2); // Canal rouge.
+		cv::bitwise_not(binary, binary);
+	}
 	cv::adaptiveThreshold(binary, binary, 255, cv::THRESH_BINARY, cv::ADAPTIVE_THRESH_MEAN_C, 75, -30);
 	cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2, 2));
 	cv::morphologyEx(binary, binary, cv::MORPH_OPEN, element);
@@ -212,112 +556,585 @@ static cv::Mat binarize(cv::Mat color)
 }
 
 /**
- * Reçoit une image noir et blanc et génère une chaine de 64 chiffres avec les
- * données de l’échantillon en niveau de gris, de résolution 8×8.
+ * Détecte les lignes de texte d’une image binaire, fusionne celles qui sont
+ * alignées et trie les lettres de chacune de gauche à droite.
  */
-static std::string extract_features(cv::Mat sample)
+static std::vector<text_line> find_text_lines(cv::Mat binary, workspace& ws)
 {
-	std::string word;
-	cv::Mat pixels;
-	cv::resize(sample, pixels, cv::Size(8, 8));
-	for (int y = 0; y < pixels.rows; ++y) {
-		for (int x = 0; x < pixels.cols; ++x) {
-			int value = pixels.at<uchar>(y, x);
-			int scaled = value * 9 / 255.;
-			word.push_back('0' + scaled);
+	stage_timer timer(STAGE_SEGMENT);
+	std::vector<text_line> lines;
+	switch (segmentation) {
+	case SEGMENT_CONTOURS:
+		lines = extract_text_lines(binary, ws);
+		break;
+	case SEGMENT_COMPONENTS:
+		lines = extract_text_components(binary, ws);
+		break;
+	case SEGMENT_PROJECTION:
+		lines = extract_text_projections(binary, ws);
+		break;
+	}
+	compact_lines(lines);
+	for (text_line& line : lines) {
+		line.sort();
+		count(LETTERS, line.letters.size());
+	}
+	return lines;
+}
+
+/**
+ * Quantification d’un niveau de gris sur 0 à 9, précalculée pour chaque valeur.
+ */
+static const std::array<uchar, 256> quantization = [] {
+	std::array<uchar, 256> table;
+	for (int value = 0; value < 256; ++value)
+		table[value] = value * 9 / 255;
+	return table;
+}();
+
+/**
+ * Reçoit une image noir et blanc et les rectangles de letter_count lettres, et
+ * écrit à la suite dans features les letter_features valeurs de chaque lettre :
+ * ses niveaux de gris en 8×8, de 0 à 9.
+ *
+ * Chaque case est la moyenne entière des pixels qu’elle couvre. Une lettre de
+ * moins de 8 px de côté voit ses pixels répétés sur plusieurs cases.
+ */
+static void extract_features(cv::Mat image, const cv::Rect* letters, size_t letter_count, uchar* features)
+{
+	for (size_t i = 0; i < letter_count; ++i) {
+		const cv::Rect& letter = letters[i];
+		std::array<int, 9> x_bounds, y_bounds;
+		for (int k = 0; k <= 8; ++k) {
+			x_bounds[k] = letter.x + k * letter.width / 8;
+			y_bounds[k] = letter.y + k * letter.height / 8;
+		}
+
+		for (int cy = 0; cy < 8; ++cy) {
+			int y0 = y_bounds[cy];
+			int y1 = std::max(y0 + 1, y_bounds[cy + 1]);
+			std::array<uint32_t, 8> sums {};
+			for (int y = y0; y < y1; ++y) {
+				const uchar* row = image.ptr<uchar>(y);
+				for (int cx = 0; cx < 8; ++cx) {
+					int x1 = std::max(x_bounds[cx] + 1, x_bounds[cx + 1]);
+					for (int x = x_bounds[cx]; x < x1; ++x)
+						sums[cx] += row[x];
+				}
+			}
+			for (int cx = 0; cx < 8; ++cx) {
+				uint32_t area = (y1 - y0) * std::max(1, x_bounds[cx + 1] - x_bounds[cx]);
+				*features++ = quantization[(sums[cx] + area / 2) / area];
+			}
 		}
 	}
-	return word;
 }
 
 /**
- * Extrait les lettres d’un reçu et écrit sur la sortie standard le contenu du
- * reçu en forme textuelle pour servir d’entrée à kakeibo.classifier --decode.
+ * Écrit les features d’une lettre sous forme textuelle : un chiffre par
+ * feature.
  */
-void scan_receipt(cv::Mat source)
+static void write_word(const uchar* features, std::FILE* output)
+{
+	char word[letter_features];
+	for (size_t i = 0; i < letter_features; ++i)
+		word[i] = '0' + features[i];
+	std::fwrite(word, 1, letter_features, output);
+}
+
+/**
+ * Équivalent binaire de la sortie de scan_receipt : une trame L par ligne
+ * contenant 64 octets par lettre, puis une trame R marquant la fin du reçu.
+ * features contient les features de toutes les lettres, dans l’ordre des
+ * lignes.
+ */
+static void write_binary_lines(const std::vector<text_line>& lines, const uchar* features, std::FILE* output)
+{
+	for (const text_line& line : lines) {
+		size_t size = line.letters.size() * letter_features;
+		write_frame(output, 'L', features, size);
+		features += size;
+	}
+	write_frame(output, 'R', nullptr, 0);
+}
+
+/**
+ * Numérote les vecteurs de features distincts parmi les letter_count
+ * lettres. Un reçu répète sans cesse les mêmes chiffres et symboles, donc il
+ * y a bien moins de vecteurs distincts que de lettres. ws.feature_indices
+ * reçoit le numéro de chaque lettre, et ws.unique_features les vecteurs
+ * distincts dans l’ordre de leur première apparition.
+ */
+static void intern_features(const uchar* features, size_t letter_count, workspace& ws)
+{
+	ws.feature_ids.clear();
+	ws.feature_indices.resize(letter_count);
+	ws.unique_features.clear();
+	for (size_t i = 0; i < letter_count; ++i) {
+		const uchar* letter = features + i * letter_features;
+		std::string_view key(reinterpret_cast<const char*>(letter), letter_features);
+		auto [id, inserted] = ws.feature_ids.try_emplace(key, ws.feature_ids.size());
+		if (inserted)
+			ws.unique_features.insert(ws.unique_features.end(), letter, letter + letter_features);
+		ws.feature_indices[i] = id->second;
+	}
+	count(DISTINCT_LETTERS, ws.feature_ids.size());
+}
+
+/**
+ * Équivalent de write_binary_lines pour --intern : une trame D contenant les
+ * vecteurs distincts, puis une trame I par ligne contenant le numéro de
+ * chaque lettre sur 4 octets petit-boutistes, puis la trame R.
+ */
+static void write_interned_lines(const std::vector<text_line>& lines, workspace& ws, std::FILE* output)
+{
+	write_frame(output, 'D', ws.unique_features.data(), ws.unique_features.size());
+	const uint32_t* index = ws.feature_indices.data();
+	for (const text_line& line : lines) {
+		ws.references.clear();
+		for (size_t i = 0; i < line.letters.size(); ++i, ++index) {
+			for (int shift = 0; shift < 32; shift += 8)
+				ws.references.push_back(*index >> shift);
+		}
+		write_frame(output, 'I', ws.references.data(), ws.references.size());
+	}
+	write_frame(output, 'R', nullptr, 0);
+}
+
+/**
+ * Découpe le reçu en lignes et en lettres, puis calcule d’un coup les
+ * features de toutes ses lettres dans ws.features, une matrice contiguë de
+ * letter_features octets par lettre, dans l’ordre des lignes. Renvoie les
+ * lignes.
+ */
+static std::vector<text_line> extract_receipt_features(cv::Mat source, workspace& ws)
 {
 	cv::Mat binary = binarize(source);
-	std::vector<text_line> lines = extract_text_lines(binary);
-	compact_lines(lines);
+	std::vector<text_line> lines = find_text_lines(binary, ws);
 
 	if (explain) {
-		cv::Mat drawing = source.clone();
+		cv::Mat drawing;
+		if (source.channels() == 1)
+			cv::cvtColor(source, drawing, cv::COLOR_GRAY2BGR);
+		else
+			drawing = source.clone();
 		draw_text_lines(drawing, lines);
 		show("detection", drawing);
 	}
 
-	for (text_line& line : lines) {
-		bool first = true;
-		line.sort();
-		for (const cv::Rect& letter : line.letters) {
-			if (first)
-				first = false;
-			else
-				std::putchar(' ');
-			std::string word = extract_features(binary(letter));
-			std::fputs(word.c_str(), stdout);
+	stage_timer timer(STAGE_FEATURES);
+	std::vector<cv::Rect>& letters = ws.letters;
+	letters.clear();
+	for (const text_line& line : lines)
+		letters.insert(letters.end(), line.letters.begin(), line.letters.end());
+	ws.features.resize(letters.size() * letter_features);
+	extract_features(binary, letters.data(), letters.size(), ws.features.data());
+	return lines;
+}
+
+/**
+ * Équivalent de scan_receipt qui renvoie les features plutôt que de les
+ * écrire, pour libkakeibo. line_lengths reçoit le nombre de lettres de chaque
+ * ligne, et features letter_features octets par lettre.
+ */
+void scan_features(cv::Mat source, std::vector<uint32_t>& line_lengths, std::vector<uchar>& features)
+{
+	workspace& ws = scratch();
+	std::vector<text_line> lines = extract_receipt_features(source, ws);
+	line_lengths.clear();
+	for (const text_line& line : lines)
+		line_lengths.push_back(line.letters.size());
+	features.assign(ws.features.begin(), ws.features.end());
+}
+
+/**
+ * Extrait les lettres d’un reçu et écrit dans output le contenu du reçu en
+ * forme textuelle pour servir d’entrée à kakeibo.classifier --decode.
+ * Si un modèle est fourni, chaque lettre est directement remplacée par son
+ * étiquette, comme le ferait kakeibo.classifier --decode. Chaque forme de
+ * lettre distincte n’est alors reconnue qu’une fois.
+ */
+void scan_receipt(cv::Mat source, const svm_model* model, std::FILE* output)
+{
+	workspace& ws = scratch();
+	std::vector<text_line> lines = extract_receipt_features(source, ws);
+	std::vector<cv::Rect>& letters = ws.letters;
+	std::vector<uchar>& features = ws.features;
+
+	if (binary_output && interned_output) {
+		intern_features(features.data(), letters.size(), ws);
+		write_interned_lines(lines, ws, output);
+		return;
+	}
+	if (binary_output) {
+		write_binary_lines(lines, features.data(), output);
+		return;
+	}
+
+	if (model) {
+		intern_features(features.data(), letters.size(), ws);
+		ws.unique_labels.resize(ws.feature_ids.size());
+		for (size_t i = 0; i < ws.unique_labels.size(); ++i)
+			ws.unique_labels[i] = &model->classify(&ws.unique_features[i * letter_features]);
+
+		const uint32_t* index = ws.feature_indices.data();
+		for (const text_line& line : lines) {
+			for (size_t i = 0; i < line.letters.size(); ++i, ++index)
+				std::fputs(ws.unique_labels[*index]->c_str(), output);
+			std::fputc('\n', output);
 		}
-		std::putchar('\n');
+		return;
+	}
+
+	const uchar* letter = features.data();
+	for (const text_line& line : lines) {
+		for (size_t i = 0; i < line.letters.size(); ++i, letter += letter_features) {
+			if (i > 0)
+				std::fputc(' ', output);
+			write_word(letter, output);
+		}
+		std::fputc('\n', output);
 	}
 }
 
 /**
- * Extrait dans pleins de petits fichiers chaque lettre contenu dans le reçu.
- * Ces images sont destinées à servir d’échantillons pour le moteur de
- * reconnaissance de lettres.
+ * Découpe chaque lettre contenue dans le reçu, destinées à être enregistrées
+ * dans pleins de petits fichiers. Ces images servent d’échantillons pour le
+ * moteur de reconnaissance de lettres.
  */
-void extract_letters(cv::Mat source)
+std::vector<cv::Mat> extract_letters(cv::Mat source)
 {
+	std::vector<cv::Mat> letters;
 	cv::Mat binary = binarize(source);
-	std::vector<text_line> lines = extract_text_lines(binary);
-	compact_lines(lines);
-	for (text_line& line : lines) {
-		line.sort();
+	for (const text_line& line : find_text_lines(binary, scratch())) {
 		for (const cv::Rect& letter : line.letters)
-			save(binary(letter));
+			letters.push_back(binary(letter));
 	}
+	return letters;
 }
 
+/** Features d’une lettre, telles qu’écrites par extract_features. */
+using letter_values = std::array<uchar, letter_features>;
+
 /**
  * Représente un échantillon stocké dans le dossier samples/, prétraité pour
- * servir à l’entrainement du modèle de reconnaissance de lettres.
+ * servir à l’entrainement du modèle de reconnaissance de lettres. mtime et
+ * size servent à savoir si l’entrée du cache est encore valable. values est
+ * vide si l’image est illisible.
  */
-struct features {
+struct sample {
 	std::string path;
-	std::string label;
-	std::string values;
+	int64_t mtime;
+	uint64_t size;
+	std::optional<letter_values> values;
 };
 
 /**
- * Construit un échantillon pour l’apprentissage depuis une image noir et
- * blanc.
+ * Calcule les features d’un échantillon depuis une image noir et blanc.
+ * Renvoie un optional vide si l’image est illisible.
  */
-static features load_features(const std::filesystem::path& path)
+static std::optional<letter_values> load_features(const std::string& path)
 {
-	cv::Mat sample = cv::imread(path, cv::IMREAD_GRAYSCALE);
-	features f;
-	f.path = path;
-	f.label = path.parent_path().filename();
-	f.values = extract_features(sample);
-	return f;
+	cv::Mat image = cv::imread(path, cv::IMREAD_GRAYSCALE);
+	if (image.empty())
+		return {};
+	letter_values values;
+	cv::Rect whole(0, 0, image.cols, image.rows);
+	extract_features(image, &whole, 1, values.data());
+	return values;
+}
+
+/*
+ * Cache de --compile. Le fichier commence par cache_magic et la version de
+ * l’extraction des features, puis le nombre d’entrées. Chaque entrée contient
+ * la longueur du chemin et le chemin, la date de modification, la taille du
+ * fichier, et les features. Les entiers sont écrits tels qu’en mémoire,
+ * dans l’ordre d’octets de la machine : le cache n’est relu que là où il a
+ * été écrit, puisque les dates de modification n’ont de sens que là.
+ *
+ * La version doit être incrémentée dès que extract_features change, pour que
+ * les caches existants soient ignorés.
+ */
+
+static const char cache_magic[8] = { 'K', 'A', 'K', 'E', 'I', 'B', 'O', 'C' };
+static const uint32_t cache_version = 1;
+
+/**
+ * Charge le cache de --compile. Un cache absent, illisible ou d’une autre
+ * version est simplement ignoré, puisqu’il ne fait que gagner du temps.
+ */
+static std::unordered_map<std::string, sample> load_cache(const char* path)
+{
+	std::unordered_map<std::string, sample> cache;
+	std::FILE* file = std::fopen(path, "rb");
+	if (!file)
+		return cache;
+
+	char magic[8];
+	uint32_t version = 0;
+	uint32_t count = 0;
+	bool ok = std::fread(magic, 1, 8, file) == 8 && std::equal(magic, magic + 8, cache_magic)
+		&& std::fread(&version, sizeof(version), 1, file) == 1 && version == cache_version
+		&& std::fread(&count, sizeof(count), 1, file) == 1;
+	for (uint32_t i = 0; ok && i < count; ++i) {
+		uint32_t length = 0;
+		sample entry;
+		letter_values values;
+		// Une longueur aberrante vient d’un cache corrompu, et ne doit pas
+		// causer une allocation démesurée.
+		ok = std::fread(&length, sizeof(length), 1, file) == 1 && length <= PATH_MAX;
+		if (!ok)
+			break;
+		entry.path.resize(length);
+		ok = ok && std::fread(entry.path.data(), 1, length, file) == length
+			&& std::fread(&entry.mtime, sizeof(entry.mtime), 1, file) == 1
+			&& std::fread(&entry.size, sizeof(entry.size), 1, file) == 1
+			&& std::fread(values.data(), 1, values.size(), file) == values.size();
+		if (ok) {
+			entry.values = values;
+			cache.emplace(entry.path, std::move(entry));
+		}
+	}
+	std::fclose(file);
+
+	// Un cache tronqué ou corrompu ne vaut pas mieux qu’un cache absent.
+	if (!ok)
+		cache.clear();
+	return cache;
+}
+
+/**
+ * Remplace le cache de --compile par les échantillons lisibles de samples.
+ * Le cache est écrit à côté puis renommé, pour ne jamais laisser de fichier
+ * à moitié écrit.
+ */
+static void save_cache(const char* path, const std::vector<sample>& samples)
+{
+	std::string temporary_path = std::string(path) + ".tmp";
+	std::FILE* file = std::fopen(temporary_path.c_str(), "wb");
+	if (!file) {
+		std::fprintf(stderr, "Impossible d’écrire le cache : %s\n", path);
+		return;
+	}
+
+	uint32_t count = std::count_if(samples.begin(), samples.end(), [](const sample& s) { return s.values.has_value(); });
+	std::fwrite(cache_magic, 1, 8, file);
+	std::fwrite(&cache_version, sizeof(cache_version), 1, file);
+	std::fwrite(&count, sizeof(count), 1, file);
+	for (const sample& s : samples) {
+		if (!s.values)
+			continue;
+		uint32_t length = s.path.size();
+		std::fwrite(&length, sizeof(length), 1, file);
+		std::fwrite(s.path.data(), 1, length, file);
+		std::fwrite(&s.mtime, sizeof(s.mtime), 1, file);
+		std::fwrite(&s.size, sizeof(s.size), 1, file);
+		std::fwrite(s.values->data(), 1, s.values->size(), file);
+	}
+
+	bool ok = !std::ferror(file);
+	ok = std::fclose(file) == 0 && ok;
+	if (!ok || std::rename(temporary_path.c_str(), path) != 0) {
+		std::fprintf(stderr, "Impossible d’écrire le cache : %s\n", path);
+		std::remove(temporary_path.c_str());
+	}
+}
+
+/*
+ * Jeu de données de --compile --dataset, conçu pour être projeté en mémoire
+ * par kakeibo.classifier sans aucune conversion. Les entiers sont
+ * petit-boutistes et chaque bloc est aligné sur son type :
+ *
+ *	char     magic[8]        "KAKEIBOD"
+ *	uint32   version
+ *	uint32   n_samples
+ *	uint32   n_labels
+ *	uint32   n_features      letter_features
+ *	uint64   labels_offset   position de la table des étiquettes
+ *	uint64   indices_offset  position des indices d’étiquette
+ *	uint64   paths_offset    position de la table des chemins
+ *	uint64   features_offset position des features, alignée sur 64 octets
+ *
+ * Une table de chaines est composée de n + 1 positions uint32, relatives à la
+ * fin de ces positions, suivies des chaines UTF-8 mises bout à bout. La chaine
+ * i va de la position i à la position i + 1. Les étiquettes sont triées, et
+ * chaque échantillon a un indice uint32 dans cette table. Les features sont
+ * une matrice uint8 de n_samples lignes de n_features valeurs de 0 à 9.
+ */
+
+static const char dataset_magic[8] = { 'K', 'A', 'K', 'E', 'I', 'B', 'O', 'D' };
+static const uint32_t dataset_version = 1;
+
+/**
+ * Ajoute à data la valeur value en petit-boutiste, sur sizeof(T) octets.
+ */
+template<typename T> static void append_le(std::string& data, T value)
+{
+	for (size_t i = 0; i < sizeof(T); ++i)
+		data.push_back(static_cast<char>(static_cast<uint64_t>(value) >> (8 * i)));
+}
+
+/**
+ * Complète data avec des octets nuls jusqu’à un multiple de alignment.
+ */
+static void align(std::string& data, size_t alignment)
+{
+	data.resize((data.size() + alignment - 1) / alignment * alignment, '\0');
+}
+
+/**
+ * Ajoute à data une table de chaines au format du jeu de données.
+ */
+static void append_string_table(std::string& data, const std::vector<const std::string*>& strings)
+{
+	uint32_t position = 0;
+	append_le<uint32_t>(data, 0);
+	for (const std::string* string : strings)
+		append_le<uint32_t>(data, position += string->size());
+	for (const std::string* string : strings)
+		data += *string;
+}
+
+/**
+ * Écrit les échantillons lisibles dans le jeu de données path. Renvoie faux
+ * si le fichier n’a pas pu être écrit.
+ */
+static bool write_dataset(const char* path, const std::vector<sample>& samples)
+{
+	std::vector<const sample*> valid;
+	std::vector<std::string> sample_labels;
+	std::map<std::string, uint32_t> label_indices;
+	for (const sample& s : samples) {
+		if (!s.values)
+			continue;
+		valid.push_back(&s);
+		sample_labels.push_back(std::filesystem::path(s.path).parent_path().filename());
+		label_indices.emplace(sample_labels.back(), 0);
+	}
+	std::vector<const std::string*> labels;
+	for (auto& [label, index] : label_indices) {
+		index = labels.size();
+		labels.push_back(&label);
+	}
+
+	std::string data(dataset_magic, 8);
+	append_le<uint32_t>(data, dataset_version);
+	append_le<uint32_t>(data, valid.size());
+	append_le<uint32_t>(data, labels.size());
+	append_le<uint32_t>(data, letter_features);
+	size_t offsets_position = data.size();
+	data.resize(data.size() + 4 * sizeof(uint64_t));
+	std::array<uint64_t, 4> offsets;
+
+	offsets[0] = data.size();
+	append_string_table(data, labels);
+
+	align(data, sizeof(uint32_t));
+	offsets[1] = data.size();
+	for (const std::string& label : sample_labels)
+		append_le<uint32_t>(data, label_indices[label]);
+
+	offsets[2] = data.size();
+	std::vector<const std::string*> paths;
+	for (const sample* s : valid)
+		paths.push_back(&s->path);
+	append_string_table(data, paths);
+
+	align(data, 64);
+	offsets[3] = data.size();
+	for (const sample* s : valid)
+		data.append(s->values->begin(), s->values->end());
+
+	std::string header_offsets;
+	for (uint64_t offset : offsets)
+		append_le<uint64_t>(header_offsets, offset);
+	data.replace(offsets_position, header_offsets.size(), header_offsets);
+
+	std::FILE* file = std::fopen(path, "wb");
+	if (!file)
+		return false;
+	bool ok = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+	return std::fclose(file) == 0 && ok;
 }
 
 /**
  * Fouille toutes les images du dossier passé en argument et bâtit un CSV pour
  * entrainer le modèle de reconnaissance de lettres. Ce format est accepté par
- * kakeibo.classifier --train.
+ * kakeibo.classifier --train. Avec --binary, chaque échantillon est écrit dans
+ * une trame S.
+ *
+ * Les échantillons sont écrits dans l’ordre de leurs chemins, quel que soit
+ * l’ordre du système de fichiers. Les images sont décodées en parallèle. Si
+ * cache_path est donné, seuls les échantillons nouveaux ou modifiés depuis le
+ * dernier appel sont décodés, les autres sont lus dans le cache, qui est
+ * ensuite mis à jour.
+ *
+ * Si dataset_path est donné, les échantillons sont écrits dans ce fichier au
+ * format du jeu de données plutôt que sur la sortie standard. Renvoie faux si
+ * ce fichier n’a pas pu être écrit.
  */
-void compile_features(const char* path)
+bool compile_features(const char* path, const char* cache_path, const char* dataset_path)
 {
+	std::vector<sample> samples;
 	for (const std::filesystem::directory_entry& entry : std::filesystem::recursive_directory_iterator(path)) {
-		if (!entry.is_regular_file())
+		if (!entry.is_regular_file() || !is_saved_extension(entry.path().extension().string()))
 			continue;
+		samples.push_back(sample {
+			entry.path(),
+			entry.last_write_time().time_since_epoch().count(),
+			entry.file_size(),
+			{},
+		});
+	}
+	std::sort(samples.begin(), samples.end(), [](const sample& a, const sample& b) {
+		return a.path < b.path;
+	});
 
-		std::filesystem::path path = entry.path();
-		if (path.extension() != ".png")
+	std::unordered_map<std::string, sample> cache;
+	if (cache_path)
+		cache = load_cache(cache_path);
+	std::vector<sample*> stale;
+	for (sample& s : samples) {
+		auto cached = cache.find(s.path);
+		if (cached != cache.end() && cached->second.mtime == s.mtime && cached->second.size == s.size)
+			s.values = cached->second.values;
+		else
+			stale.push_back(&s);
+	}
+
+	cv::parallel_for_(cv::Range(0, stale.size()), [&](const cv::Range& range) {
+		for (int i = range.start; i < range.end; ++i)
+			stale[i]->values = load_features(stale[i]->path);
+	});
+
+	bool ok = true;
+	for (const sample& s : samples) {
+		if (!s.values) {
+			std::fprintf(stderr, "Échantillon illisible : %s\n", s.path.c_str());
+			continue;
+		}
+		if (dataset_path)
 			continue;
+		std::string label = std::filesystem::path(s.path).parent_path().filename();
+		if (binary_output) {
+			std::string payload(s.values->begin(), s.values->end());
+			payload += label;
+			payload.push_back('\0');
+			payload += s.path;
+			write_frame(stdout, 'S', payload.data(), payload.size());
+		} else {
+			std::printf("%s,%s,", s.path.c_str(), label.c_str());
+			write_word(s.values->data(), stdout);
+			std::putchar('\n');
+		}
+	}
 
-		features f = load_features(path);
-		std::printf("%s,%s,%s\n", f.path.c_str(), f.label.c_str(), f.values.c_str());
+	if (dataset_path && !write_dataset(dataset_path, samples)) {
+		std::fprintf(stderr, "Impossible d’écrire le jeu de données : %s\n", dataset_path);
+		ok = false;
 	}
+
+	if (cache_path)
+		save_cache(cache_path, samples);
+	return ok;
 }
@@ -3,14 +3,147 @@
 #include <opencv2/core.hpp>
 
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 // receipt-scanner.cc
 
 extern bool explain;
+extern bool binary_output;
+extern bool interned_output;
 void show(const std::string& name, cv::Mat image);
+void write_frame(std::FILE* output, char type, const void* data, size_t size);
+
+/**
+ * Mesures collectées pour --profile sur un fichier d’entrée. Les reçus d’une
+ * même photo pouvant être traités en parallèle, tout est atomique, et les
+ * durées des étapes sont cumulées sur tous les reçus.
+ */
+enum profile_stage { STAGE_DECODE, STAGE_DETECT, STAGE_WARP, STAGE_BINARIZE, STAGE_SEGMENT, STAGE_FEATURES, STAGE_COUNT };
+enum profile_counter {
+	CONTOURS, NOT_RECTANGLES, TOO_SMALL, TOO_WIDE, RECEIPTS,
+	SATURATION_THRESHOLD, DETECTION_PASSES,
+	NOISE_LINES, MERGED_LINES, NOISE_LETTERS, LETTERS, DISTINCT_LETTERS,
+	COUNTER_COUNT
+};
+
+struct profile {
+	std::array<std::atomic<int64_t>, STAGE_COUNT> stages {};
+	std::array<std::atomic<int64_t>, COUNTER_COUNT> counters {};
+	int64_t wall = 0; // Durée totale, en nanosecondes.
+	std::string to_json(const std::string& file) const;
+};
+
+/** Profil du fichier en cours de traitement, nul sans --profile. */
+extern thread_local profile* current_profile;
+
+inline void count(profile_counter counter, int64_t n = 1)
+{
+	if (current_profile)
+		current_profile->counters[counter] += n;
+}
+
+/**
+ * Ajoute au profil courant la durée de vie de l’objet.
+ */
+struct stage_timer {
+	profile_stage stage;
+	std::chrono::steady_clock::time_point start;
+
+	stage_timer(profile_stage stage) : stage(stage)
+	{
+		if (current_profile)
+			start = std::chrono::steady_clock::now();
+	}
+
+	~stage_timer()
+	{
+		if (current_profile)
+			current_profile->stages[stage] += (std::chrono::steady_clock::now() - start).count();
+	}
+};
+
+// writer.cc
+
+enum image_format { FORMAT_PNG, FORMAT_WEBP, FORMAT_PNM };
+enum sync_policy { SYNC_NONE, SYNC_FILE, SYNC_END };
+
+extern image_format output_format;
+extern int png_level;
+extern sync_policy output_sync;
 std::string save(cv::Mat image);
+void flush_images();
+bool close_images();
+
+/**
+ * Vrai si l’extension, point compris, est celle d’un des formats que save
+ * peut écrire, pour que les lettres de --extract puissent toutes être
+ * relues par --compile.
+ */
+inline bool is_saved_extension(std::string_view extension)
+{
+	return extension == ".png" || extension == ".webp" || extension == ".pgm" || extension == ".ppm";
+}
+
+// workspace.cc
+
+/**
+ * Tampons d’image du workspace. Chaque usage a le sien pour que deux images
+ * utilisées en même temps ne partagent jamais la même mémoire.
+ */
+enum workspace_slot {
+	SLOT_SMALL, SLOT_REDUCED, SLOT_HSV, SLOT_SATURATION, SLOT_VALUE, SLOT_MASK, SLOT_MASK_LAST = SLOT_MASK + 2,
+	SLOT_CORNER, SLOT_CORNER_LABELS,
+	SLOT_LINES, SLOT_LINE, SLOT_LINE_MASK, SLOT_LABELS,
+	SLOT_COUNT
+};
+
+/**
+ * Mémoire de travail réutilisée d’une ligne, d’un reçu et d’une photo à
+ * l’autre. Chaque thread a le sien, obtenu par scratch(), et les fonctions de
+ * cutter.cc et detector.cc se le passent au lieu d’allouer leurs propres
+ * images et listes de contours.
+ */
+struct workspace {
+	cv::Mat buffer(workspace_slot slot, cv::Size size, int type);
+	void release();
+	std::vector<cv::Point> hull;
+	std::vector<std::vector<cv::Point>> photo_contours;
+	std::vector<std::vector<cv::Point>> line_contours;
+	std::vector<std::vector<cv::Point>> letter_contours;
+	cv::Mat component_stats;
+	cv::Mat component_centroids;
+	std::vector<cv::Rect> components;
+	std::vector<cv::Rect> glyphs;
+	std::vector<int> line_parents;
+	std::vector<int> glyph_parents;
+	std::vector<int> line_indices;
+	std::vector<std::vector<int>> cells;
+	std::vector<int> row_profile;
+	std::vector<uchar> column_profile;
+	std::vector<int> strip_profiles;
+	std::vector<int> deskewed_profile;
+	std::vector<int> band_heights;
+	std::vector<cv::Range> bands;
+	std::vector<cv::Range> sub_bands;
+	std::vector<cv::Rect> letters;
+	std::vector<uchar> features;
+	std::unordered_map<std::string_view, uint32_t> feature_ids;
+	std::vector<uint32_t> feature_indices;
+	std::vector<uchar> unique_features;
+	std::vector<const std::string*> unique_labels;
+	std::vector<uchar> references;
+private:
+	std::array<cv::Mat, SLOT_COUNT> buffers;
+};
+
+workspace& scratch();
 
 // cutter.cc
 
@@ -22,11 +155,49 @@ struct quad {
 	void shrink(int border);
 };
 
+/**
+ * Reçus trouvés par detect_receipts sur une image réduite scale fois, avec le
+ * seuil de saturation retenu pour affiner leurs coins.
+ */
+struct receipt_detection {
+	std::vector<quad> receipts;
+	int scale;
+	int saturation_threshold;
+};
+
+enum threshold_strategy { THRESHOLD_SEARCH, THRESHOLD_HISTOGRAM };
+
+extern int detection_scale;
+extern threshold_strategy saturation_strategy;
+extern size_t memory_budget;
 std::vector<quad> find_receipts(cv::Mat photo);
-cv::Mat cut_receipt(cv::Mat photo, quad contour);
+receipt_detection detect_receipts(cv::Mat image, int scale);
+std::vector<quad> refine_receipts(cv::Mat photo, const receipt_detection& detection);
+cv::Mat cut_receipt(cv::Mat photo, quad contour, bool red_only = false);
+
+// classifier.cc
+
+/** Nombre de features par lettre : ses niveaux de gris en 8×8, de 0 à 9. */
+constexpr size_t letter_features = 64;
+
+struct svm_model {
+	std::vector<std::string> labels;
+	std::vector<size_t> support_offsets;
+	size_t feature_count;
+	double gamma;
+	std::vector<double> intercepts;
+	std::vector<double> support_vectors;
+	std::vector<double> coefficients;
+	const std::string& classify(const uint8_t* features) const;
+};
+
+std::optional<svm_model> load_svm_model(const char* path);
 
 // detector.cc
 
-void scan_receipt(cv::Mat photo);
-void extract_letters(cv::Mat photo);
-void compile_features(const char *samples_path);
+enum segmentation_engine { SEGMENT_CONTOURS, SEGMENT_COMPONENTS, SEGMENT_PROJECTION };
+extern segmentation_engine segmentation;
+void scan_receipt(cv::Mat photo, const svm_model* model, std::FILE* output);
+void scan_features(cv::Mat photo, std::vector<uint32_t>& line_lengths, std::vector<uchar>& features);
+std::vector<cv::Mat> extract_letters(cv::Mat photo);
+bool compile_features(const char* samples_path, const char* cache_path, const char* dataset_path);
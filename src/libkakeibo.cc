@@ -0,0 +1,145 @@
+/*
+ * Implémentation de l’API C de libkakeibo, décrite dans libkakeibo.h.
+ *
+ * La bibliothèque regroupe classifier.cc, cutter.cc et detector.cc sans
+ * receipt-scanner.cc, dont stubs.cc remplace les quelques fonctions et options
+ * qu’ils utilisent par des versions inertes.
+ */
+
+#include "kakeibo.h"
+#include "libkakeibo.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+static_assert(KAKEIBO_LETTER_FEATURES == letter_features);
+
+/**
+ * Vue OpenCV sur une image de l’appelant, sans copie. Renvoie une image vide
+ * si elle n’a pas channels canaux.
+ */
+static cv::Mat wrap_image(const kakeibo_image* image, int channels)
+{
+	if (!image || !image->data || image->rows <= 0 || image->cols <= 0 || image->channels != channels)
+		return {};
+	return cv::Mat(image->rows, image->cols, CV_8UC(channels), image->data, image->stride);
+}
+
+/**
+ * Exécute f en convertissant les exceptions, d’OpenCV ou d’allocation, en
+ * code d’erreur : elles ne doivent pas traverser l’API C.
+ */
+template<typename F>
+static int guard(F f)
+{
+	try {
+		return f();
+	} catch (...) {
+		return KAKEIBO_FAILED;
+	}
+}
+
+int kakeibo_api_version(void)
+{
+	return KAKEIBO_API_VERSION;
+}
+
+int kakeibo_find_receipts(const kakeibo_image* photo, kakeibo_quad* receipts, int capacity)
+{
+	cv::Mat source = wrap_image(photo, 3);
+	if (source.empty())
+		return KAKEIBO_INVALID_IMAGE;
+
+	return guard([&] {
+		std::vector<quad> found = find_receipts(source);
+		for (int i = 0; i < capacity && i < int(found.size()); ++i) {
+			for (int c = 0; c < 4; ++c) {
+				receipts[i].corners[2 * c] = found[i].corners[c].x;
+				receipts[i].corners[2 * c + 1] = found[i].corners[c].y;
+			}
+		}
+		return int(found.size());
+	});
+}
+
+/** Implémente kakeibo_cut_receipt et kakeibo_cut_receipt_red. */
+static int cut(const kakeibo_image* photo, const kakeibo_quad* receipt, kakeibo_image* result, bool red_only)
+{
+	cv::Mat source = wrap_image(photo, 3);
+	if (source.empty())
+		return KAKEIBO_INVALID_IMAGE;
+
+	return guard([&] {
+		std::vector<cv::Point> corners;
+		for (int c = 0; c < 4; ++c)
+			corners.emplace_back(receipt->corners[2 * c], receipt->corners[2 * c + 1]);
+		cv::Mat cut = cut_receipt(source, quad(corners), red_only);
+
+		size_t stride = cut.cols * cut.elemSize();
+		uint8_t* data = static_cast<uint8_t*>(std::malloc(stride * cut.rows));
+		if (!data)
+			return int(KAKEIBO_FAILED);
+		for (int y = 0; y < cut.rows; ++y)
+			std::memcpy(data + y * stride, cut.ptr(y), stride);
+		*result = { data, cut.rows, cut.cols, cut.channels(), stride };
+		return int(KAKEIBO_OK);
+	});
+}
+
+int kakeibo_cut_receipt(const kakeibo_image* photo, const kakeibo_quad* receipt, kakeibo_image* result)
+{
+	return cut(photo, receipt, result, false);
+}
+
+int kakeibo_cut_receipt_red(const kakeibo_image* photo, const kakeibo_quad* receipt, kakeibo_image* result)
+{
+	return cut(photo, receipt, result, true);
+}
+
+int kakeibo_scan_receipt(const kakeibo_image* receipt, kakeibo_scan* result)
+{
+	cv::Mat source = wrap_image(receipt, receipt && receipt->channels == 1 ? 1 : 3);
+	if (source.empty())
+		return KAKEIBO_INVALID_IMAGE;
+
+	return guard([&] {
+		std::vector<uint32_t> line_lengths;
+		std::vector<uchar> features;
+		scan_features(source, line_lengths, features);
+
+		// malloc(0) peut renvoyer nul, d’où au moins un élément.
+		uint32_t* lengths = static_cast<uint32_t*>(std::malloc(std::max<size_t>(1, line_lengths.size()) * sizeof(uint32_t)));
+		uint8_t* letters = static_cast<uint8_t*>(std::malloc(std::max<size_t>(1, features.size())));
+		if (!lengths || !letters) {
+			std::free(lengths);
+			std::free(letters);
+			return int(KAKEIBO_FAILED);
+		}
+		std::copy(line_lengths.begin(), line_lengths.end(), lengths);
+		std::copy(features.begin(), features.end(), letters);
+		*result = {
+			uint32_t(line_lengths.size()), lengths,
+			uint32_t(features.size() / letter_features), letters,
+		};
+		return int(KAKEIBO_OK);
+	});
+}
+
+void kakeibo_free_image(kakeibo_image* image)
+{
+	if (!image)
+		return;
+	std::free(image->data);
+	image->data = nullptr;
+}
+
+void kakeibo_free_scan(kakeibo_scan* scan)
+{
+	if (!scan)
+		return;
+	std::free(scan->line_lengths);
+	std::free(scan->features);
+	scan->line_lengths = nullptr;
+	scan->features = nullptr;
+}
@@ -0,0 +1,99 @@
+/*
+ * API C de libkakeibo, pour détecter, découper et scanner les reçus dans le
+ * processus de l’appelant plutôt qu’en passant par receipt-scanner.
+ *
+ * Les images sont fournies par l’appelant, sans copie : 8 bits par canal, en
+ * BGR comme avec OpenCV. Les résultats sont renvoyés dans des structures à
+ * libérer avec la fonction kakeibo_free_* correspondante. Rien n’est écrit sur
+ * la sortie standard.
+ *
+ * Toutes les fonctions peuvent être appelées depuis plusieurs threads à la
+ * fois. Elles renvoient KAKEIBO_OK, ou un code d’erreur négatif.
+ *
+ * La compatibilité est assurée tant que KAKEIBO_API_VERSION ne change pas.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KAKEIBO_API_VERSION 2
+
+#define KAKEIBO_EXPORT __attribute__((visibility("default")))
+
+enum {
+	KAKEIBO_OK = 0,
+	KAKEIBO_INVALID_IMAGE = -1, /* Image vide, ou qui n’est pas en BGR. */
+	KAKEIBO_FAILED = -2, /* Erreur interne, d’allocation ou d’OpenCV. */
+};
+
+/** Image de rows × cols pixels, de stride octets par ligne. */
+typedef struct {
+	uint8_t* data;
+	int32_t rows;
+	int32_t cols;
+	int32_t channels;
+	size_t stride;
+} kakeibo_image;
+
+/**
+ * Coins d’un reçu sur la photo, x puis y, dans l’ordre haut-gauche,
+ * haut-droite, bas-droite, bas-gauche.
+ */
+typedef struct {
+	int32_t corners[8];
+} kakeibo_quad;
+
+/**
+ * Features d’un reçu scanné, telles qu’écrites par receipt-scanner --scan
+ * --binary : letter_count lettres de KAKEIBO_LETTER_FEATURES octets, de 0 à 9,
+ * réparties en line_count lignes de line_lengths[i] lettres.
+ */
+typedef struct {
+	uint32_t line_count;
+	uint32_t* line_lengths;
+	uint32_t letter_count;
+	uint8_t* features;
+} kakeibo_scan;
+
+#define KAKEIBO_LETTER_FEATURES 64
+
+/** Renvoie la KAKEIBO_API_VERSION de la bibliothèque chargée. */
+KAKEIBO_EXPORT int kakeibo_api_version(void);
+
+/**
+ * Cherche les reçus de la photo, en BGR. Écrit au plus capacity reçus dans
+ * receipts et renvoie le nombre de reçus trouvés, qui peut dépasser capacity.
+ */
+KAKEIBO_EXPORT int kakeibo_find_receipts(const kakeibo_image* photo, kakeibo_quad* receipts, int capacity);
+
+/**
+ * Découpe un reçu de la photo en le redressant. result reçoit une image BGR
+ * à libérer avec kakeibo_free_image.
+ */
+KAKEIBO_EXPORT int kakeibo_cut_receipt(const kakeibo_image* photo, const kakeibo_quad* receipt, kakeibo_image* result);
+
+/**
+ * Comme kakeibo_cut_receipt, mais result ne garde que le canal rouge, le seul
+ * que lit kakeibo_scan_receipt : c’est le découpage à faire avant un scan.
+ */
+KAKEIBO_EXPORT int kakeibo_cut_receipt_red(const kakeibo_image* photo, const kakeibo_quad* receipt, kakeibo_image* result);
+
+/**
+ * Scanne un reçu découpé, en BGR ou réduit à son seul canal rouge. result
+ * reçoit ses features, à libérer avec kakeibo_free_scan.
+ */
+KAKEIBO_EXPORT int kakeibo_scan_receipt(const kakeibo_image* receipt, kakeibo_scan* result);
+
+/** Libèrent un résultat. Sans effet sur un pointeur nul. */
+KAKEIBO_EXPORT void kakeibo_free_image(kakeibo_image* image);
+KAKEIBO_EXPORT void kakeibo_free_scan(kakeibo_scan* scan);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,459 @@
+/*
+ * Micro-benchmarks des étapes de receipt-scanner, pour repérer les régressions
+ * de performance avant de déployer.
+ *
+ * Les étapes mesurées sont des fonctions statiques de cutter.cc et
+ * detector.cc, donc on inclut directement ces fichiers plutôt que de les lier.
+ * Les quelques fonctions de receipt-scanner.cc dont ils dépendent sont
+ * remplacées par les versions inertes de stubs.cc.
+ *
+ * Les échantillons de letters/ servent pour extract_features. Les photos de t/
+ * servent pour la détection et le découpage, puis les reçus découpés servent
+ * pour toutes les étapes de detector.cc. Sans photo, seules les étapes sur les
+ * lettres sont mesurées.
+ *
+ * Pour chaque étape, on affiche le temps par appel, le débit en mégapixels par
+ * seconde et le nombre d’allocations par appel. Chaque mesure est répétée
+ * plusieurs fois et on garde la plus rapide, qui est la plus reproductible.
+ */
+
+#include "cutter.cc"
+#include "detector.cc"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+/*
+ * Compte les allocations en interceptant malloc et ses variantes, qu’utilisent
+ * aussi bien operator new que cv::fastMalloc. Uniquement avec la glibc, qui
+ * expose ses implémentations sous le préfixe __libc_.
+ */
+
+static std::atomic<size_t> allocations = 0;
+
+#ifdef __GLIBC__
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* pointer, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size) noexcept
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) noexcept
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(pointer, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** pointer, size_t alignment, size_t size) noexcept
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	*pointer = __libc_memalign(alignment, size);
+	return *pointer ? 0 : ENOMEM;
+}
+
+}
+#endif
+
+/** Durée minimale de chaque répétition d’une mesure. */
+static const std::chrono::nanoseconds minimum_duration = std::chrono::milliseconds(100);
+
+/** Nombre de répétitions de chaque mesure. */
+static const int repetitions = 5;
+
+/**
+ * Mesure une étape. run traite une fois tout le jeu d’entrées et renvoie le
+ * nombre d’appels effectués. pixels est le nombre de pixels traités par ce
+ * passage complet.
+ */
+template<typename F>
+static void measure(const char* name, double pixels, F run)
+{
+	// Échauffement, pour ne pas compter les allocations initiales.
+	size_t calls_per_pass = run();
+	if (calls_per_pass == 0)
+		return;
+
+	double best_ns = 0;
+	double allocations_per_call = 0;
+	for (int r = 0; r < repetitions; ++r) {
+		size_t calls = 0;
+		size_t allocations_before = allocations.load();
+		auto start = std::chrono::steady_clock::now();
+		std::chrono::nanoseconds elapsed;
+		do {
+			calls += run();
+			elapsed = std::chrono::steady_clock::now() - start;
+		} while (elapsed < minimum_duration);
+
+		double ns = double(elapsed.count()) / calls;
+		if (r == 0 || ns < best_ns) {
+			best_ns = ns;
+			allocations_per_call = double(allocations.load() - allocations_before) / calls;
+		}
+	}
+
+	// pixels / ns × 1000 = mégapixels / s.
+	double megapixels_per_s = pixels / calls_per_pass / best_ns * 1e3;
+	std::printf("%-24s %14.0f ns/op %10.2f MP/s %10.1f allocs/op\n", name, best_ns, megapixels_per_s, allocations_per_call);
+}
+
+static double count_pixels(const std::vector<cv::Mat>& images)
+{
+	double pixels = 0;
+	for (const cv::Mat& image : images)
+		pixels += image.total();
+	return pixels;
+}
+
+/**
+ * Charge les images du dossier, récursivement, dans l’ordre des noms pour
+ * que les mesures soient reproductibles.
+ */
+static std::vector<cv::Mat> load_images(const char* directory, int flags)
+{
+	std::vector<std::filesystem::path> paths;
+	if (!std::filesystem::is_directory(directory))
+		return {};
+	for (const auto& entry : std::filesystem::recursive_directory_iterator(directory)) {
+		std::string extension = entry.path().extension();
+		if (entry.is_regular_file() && (is_saved_extension(extension) || extension == ".jpg" || extension == ".jpeg"))
+			paths.push_back(entry.path());
+	}
+	std::sort(paths.begin(), paths.end());
+
+	std::vector<cv::Mat> images;
+	for (const auto& path : paths) {
+		cv::Mat image = cv::imread(path, flags);
+		if (!image.empty())
+			images.push_back(image);
+	}
+	return images;
+}
+
+/**
+ * Charge le contenu encodé des JPEG du dossier, dans l’ordre des noms.
+ */
+static std::vector<std::vector<uchar>> load_jpegs(const char* directory)
+{
+	std::vector<std::filesystem::path> paths;
+	if (!std::filesystem::is_directory(directory))
+		return {};
+	for (const auto& entry : std::filesystem::recursive_directory_iterator(directory)) {
+		std::string extension = entry.path().extension();
+		if (entry.is_regular_file() && (extension == ".jpg" || extension == ".jpeg"))
+			paths.push_back(entry.path());
+	}
+	std::sort(paths.begin(), paths.end());
+
+	std::vector<std::vector<uchar>> files;
+	for (const auto& path : paths) {
+		std::ifstream file(path, std::ios::binary);
+		files.emplace_back(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+	return files;
+}
+
+/**
+ * Reproduit la préparation de find_receipts_in_mask, avec le seuil de
+ * saturation 32, pour obtenir les contours passés à approximate_rectangle.
+ */
+static std::vector<std::vector<cv::Point>> photo_contours(cv::Mat photo)
+{
+	cv::Mat image;
+	cv::cvtColor(photo, image, cv::COLOR_BGR2HSV);
+	cv::inRange(image, cv::Scalar(0, 0, 128), cv::Scalar(255, 32, 255), image);
+	cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(9, 9));
+	cv::morphologyEx(image, image, cv::MORPH_OPEN, element);
+	std::vector<std::vector<cv::Point>> contours;
+	cv::findContours(image, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+	return contours;
+}
+
+/**
+ * Reproduit la préparation de extract_text_lines pour obtenir les contours
+ * passés à extract_text_line.
+ */
+static std::vector<std::vector<cv::Point>> line_contours(cv::Mat binary)
+{
+	cv::Mat dilated;
+	cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(19, 5));
+	cv::morphologyEx(binary, dilated, cv::MORPH_CLOSE, element);
+	std::vector<std::vector<cv::Point>> contours;
+	cv::findContours(dilated, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
+	return contours;
+}
+
+/**
+ * Compare les coins trouvés avec --detect-scale scale à ceux de la détection
+ * en pleine résolution, qui servent de référence. Affiche le nombre de photos
+ * où les mêmes reçus sont trouvés, et l’écart maximal et moyen des coins, en
+ * pixels sur le plus grand des deux axes.
+ */
+static void compare_detection_scale(const std::vector<cv::Mat>& photos, int scale)
+{
+	int previous_scale = detection_scale;
+	size_t matching_photos = 0;
+	size_t corner_count = 0;
+	double total_error = 0;
+	int max_error = 0;
+	for (const cv::Mat& photo : photos) {
+		detection_scale = 1;
+		std::vector<quad> reference = find_receipts(photo);
+		detection_scale = scale;
+		std::vector<quad> reduced = find_receipts(photo);
+		if (reference.size() != reduced.size())
+			continue;
+		++matching_photos;
+		for (size_t i = 0; i < reference.size(); ++i) {
+			for (size_t c = 0; c < 4; ++c) {
+				cv::Point d = reduced[i].corners[c] - reference[i].corners[c];
+				int error = std::max(std::abs(d.x), std::abs(d.y));
+				max_error = std::max(max_error, error);
+				total_error += error;
+				++corner_count;
+			}
+		}
+	}
+	detection_scale = previous_scale;
+
+	std::printf("--detect-scale %d : mêmes reçus sur %zu photos sur %zu, écart des coins de %d px au plus, %.1f px en moyenne\n",
+		scale, matching_photos, photos.size(), max_error, corner_count ? total_error / corner_count : 0.);
+}
+
+int main(int argc, char** argv)
+{
+	const char* letters_directory = argc > 1 ? argv[1] : "letters";
+	const char* photos_directory = argc > 2 ? argv[2] : "t";
+	if (argc > 3) {
+		std::fputs("Usage: receipt-bench [LETTRES [PHOTOS]]\n", stderr);
+		return 2;
+	}
+
+	std::vector<cv::Mat> letters = load_images(letters_directory, cv::IMREAD_GRAYSCALE);
+	std::vector<cv::Mat> photos = load_images(photos_directory, cv::IMREAD_COLOR);
+	std::printf("%zu lettres dans %s, %zu photos dans %s\n\n", letters.size(), letters_directory, photos.size(), photos_directory);
+
+	workspace& ws = scratch();
+	std::vector<uchar> features;
+	measure("extract_features", count_pixels(letters), [&] {
+		features.resize(letter_features);
+		for (const cv::Mat& letter : letters) {
+			cv::Rect whole(0, 0, letter.cols, letter.rows);
+			extract_features(letter, &whole, 1, features.data());
+		}
+		return letters.size();
+	});
+
+	if (photos.empty()) {
+		std::puts("\nAucune photo : les étapes de détection et de découpage sont ignorées.");
+		return 0;
+	}
+
+	// Préparation des entrées de chaque étape à partir des photos.
+	std::vector<std::pair<cv::Mat, quad>> quads;
+	std::vector<std::vector<cv::Point>> contours;
+	for (const cv::Mat& photo : photos) {
+		for (const quad& q : find_receipts(photo))
+			quads.emplace_back(photo, q);
+		for (auto& contour : photo_contours(photo))
+			contours.push_back(std::move(contour));
+	}
+
+	std::vector<cv::Mat> receipts;
+	for (auto& [photo, q] : quads)
+		receipts.push_back(cut_receipt(photo, q));
+
+	std::vector<cv::Mat> binaries;
+	std::vector<std::pair<cv::Mat, std::vector<cv::Point>>> lines_contours;
+	std::vector<std::vector<text_line>> receipts_lines;
+	// Rectangles des lettres de chaque reçu, dans l’ordre de binaries.
+	std::vector<std::vector<cv::Rect>> receipt_letters;
+	size_t letter_count = 0;
+	double letter_pixels = 0;
+	for (const cv::Mat& receipt : receipts) {
+		cv::Mat binary = binarize(receipt);
+		binaries.push_back(binary);
+		for (auto& contour : line_contours(binary))
+			lines_contours.emplace_back(binary, std::move(contour));
+		std::vector<text_line> lines = extract_text_lines(binary, ws);
+		std::vector<cv::Rect>& rects = receipt_letters.emplace_back();
+		for (const text_line& line : lines) {
+			for (const cv::Rect& letter : line.letters) {
+				rects.push_back(letter);
+				letter_pixels += letter.area();
+			}
+		}
+		letter_count += rects.size();
+		receipts_lines.push_back(std::move(lines));
+	}
+
+	std::printf("%zu reçus, %zu contours de photo, %zu contours de ligne, %zu lettres\n",
+		receipts.size(), contours.size(), lines_contours.size(), letter_count);
+	for (int scale : { 2, 4, 8 })
+		compare_detection_scale(photos, scale);
+	std::putchar('\n');
+
+	// Les deux façons de décoder une photo avec --detect-scale 4 : en entier
+	// puis réduite comme le fait find_receipts, ou en réduit pour la
+	// détection puis en entier si elle contient des reçus, comme le fait
+	// receipt-scanner pour les JPEG. Le décodage réduit seul correspond aux
+	// photos sans reçu.
+	std::vector<std::vector<uchar>> jpegs = load_jpegs(photos_directory);
+	double jpeg_pixels = 0;
+	for (const std::vector<uchar>& jpeg : jpegs)
+		jpeg_pixels += cv::imdecode(jpeg, cv::IMREAD_COLOR).total();
+	measure("imdecode+resize/4", jpeg_pixels, [&] {
+		for (const std::vector<uchar>& jpeg : jpegs) {
+			cv::Mat photo = cv::imdecode(jpeg, cv::IMREAD_COLOR);
+			cv::Mat reduced;
+			cv::resize(photo, reduced, cv::Size(), 0.25, 0.25, cv::INTER_AREA);
+		}
+		return jpegs.size();
+	});
+	measure("imdecode/réduit 4+entier", jpeg_pixels, [&] {
+		for (const std::vector<uchar>& jpeg : jpegs) {
+			cv::imdecode(jpeg, cv::IMREAD_REDUCED_COLOR_4);
+			cv::imdecode(jpeg, cv::IMREAD_COLOR);
+		}
+		return jpegs.size();
+	});
+	measure("imdecode/réduit 4", jpeg_pixels, [&] {
+		for (const std::vector<uchar>& jpeg : jpegs)
+			cv::imdecode(jpeg, cv::IMREAD_REDUCED_COLOR_4);
+		return jpegs.size();
+	});
+
+	// La détection complète, telle que l’appelle receipt-scanner, avec les
+	// options qui changent son chemin.
+	struct detection_options {
+		const char* name;
+		int scale;
+		threshold_strategy strategy;
+		size_t budget;
+	};
+	for (const detection_options& options : {
+		detection_options { "find_receipts", 1, THRESHOLD_SEARCH, 0 },
+		detection_options { "find_receipts/échelle 4", 4, THRESHOLD_SEARCH, 0 },
+		detection_options { "find_receipts/histogramme", 1, THRESHOLD_HISTOGRAM, 0 },
+		detection_options { "find_receipts/64 Mio", 1, THRESHOLD_SEARCH, size_t(64) << 20 },
+	}) {
+		detection_scale = options.scale;
+		saturation_strategy = options.strategy;
+		memory_budget = options.budget;
+		measure(options.name, count_pixels(photos), [&] {
+			for (const cv::Mat& photo : photos)
+				find_receipts(photo);
+			return photos.size();
+		});
+	}
+	detection_scale = 1;
+	saturation_strategy = THRESHOLD_SEARCH;
+	memory_budget = 0;
+
+	// Les trois masques de la recherche, à partir d’une seule conversion.
+	measure("saturation_masks", count_pixels(photos), [&] {
+		std::array<cv::Mat, 3> masks;
+		for (const cv::Mat& photo : photos) {
+			hsv_strips hsv { photo, photo.rows, {} };
+			saturation_masks(hsv, saturation_thresholds.data(), masks.size(), masks.data(), ws);
+		}
+		return photos.size();
+	});
+
+	measure("approximate_rectangle", 0, [&] {
+		for (const auto& contour : contours)
+			approximate_rectangle(contour);
+		return contours.size();
+	});
+
+	measure("cut_receipt", count_pixels(receipts), [&] {
+		for (auto& [photo, q] : quads)
+			cut_receipt(photo, q);
+		return quads.size();
+	});
+
+	measure("cut_receipt/rouge", count_pixels(receipts), [&] {
+		for (auto& [photo, q] : quads)
+			cut_receipt(photo, q, true);
+		return quads.size();
+	});
+
+	measure("binarize", count_pixels(receipts), [&] {
+		for (const cv::Mat& receipt : receipts)
+			binarize(receipt);
+		return receipts.size();
+	});
+
+	measure("extract_text_lines", count_pixels(binaries), [&] {
+		for (const cv::Mat& binary : binaries)
+			extract_text_lines(binary, ws);
+		return binaries.size();
+	});
+
+	measure("extract_text_components", count_pixels(binaries), [&] {
+		for (const cv::Mat& binary : binaries)
+			extract_text_components(binary, ws);
+		return binaries.size();
+	});
+
+	measure("extract_text_projections", count_pixels(binaries), [&] {
+		for (const cv::Mat& binary : binaries)
+			extract_text_projections(binary, ws);
+		return binaries.size();
+	});
+
+	double line_pixels = 0;
+	for (auto& [binary, contour] : lines_contours)
+		line_pixels += cv::boundingRect(contour).area();
+	measure("extract_text_line", line_pixels, [&] {
+		for (auto& [binary, contour] : lines_contours)
+			extract_text_line(binary, contour, ws);
+		return lines_contours.size();
+	});
+
+	// compact_lines modifie les lignes, donc on travaille sur une copie.
+	// La copie est comprise dans la mesure.
+	measure("compact_lines", 0, [&] {
+		for (const std::vector<text_line>& lines : receipts_lines) {
+			std::vector<text_line> copy = lines;
+			compact_lines(copy);
+		}
+		return receipts_lines.size();
+	});
+
+	// Toutes les lettres d’un reçu en un appel, comme scan_receipt.
+	measure("extract_features/reçu", letter_pixels, [&] {
+		for (size_t i = 0; i < binaries.size(); ++i) {
+			features.resize(receipt_letters[i].size() * letter_features);
+			extract_features(binaries[i], receipt_letters[i].data(), receipt_letters[i].size(), features.data());
+		}
+		return letter_count;
+	});
+
+	return 0;
+}
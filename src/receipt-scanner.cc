@@ -7,21 +7,58 @@
 #  include <opencv2/highgui.hpp>
 #endif
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
-#include <filesystem>
+#include <cstring>
+#include <functional>
 #include <getopt.h>
+#include <iterator>
+#include <mutex>
 #include <set>
+#include <thread>
+
+#include <sys/resource.h>
 
 /** Si activé via --explain, affiche visuellement les données traitées. */
 bool explain = false;
 
+/** Si activé via --binary, --scan et --compile écrivent des trames binaires. */
+bool binary_output = false;
+
+/** Si activé via --intern, --scan --binary n’écrit qu’une fois chaque lettre. */
+bool interned_output = false;
+
 char mode = 0;
 bool cut = false;
+bool serve = false;
+int jobs = 1;
+bool profiling = false;
+
+/** Si activé via --stream, chaque reçu scanné est écrit dès qu’il est prêt. */
+bool streaming = false;
+
+/** Cache des features de --compile, donné par --cache. */
+const char* cache_path = nullptr;
+
+/** Jeu de données écrit par --compile à la place du CSV, donné par --dataset. */
+const char* dataset_path = nullptr;
+
+thread_local profile* current_profile = nullptr;
+
+/** Modèle chargé via --decode, pour que --scan sorte directement du texte. */
+std::optional<svm_model> model;
 
 static const char* usage =
-	"Usage: receipt-scanner [--cut] [--scan|--extract] FICHIER…\n"
-	"       receipt-scanner --compile DOSSIER\n"
+	"Usage: receipt-scanner [--cut] [--scan|--extract] [--decode MODÈLE|--binary [--intern]]\n"
+	"                       [--jobs N] [--detect-scale N] [--max-memory MIO]\n"
+	"                       [--threshold MÉTHODE] [--segment MOTEUR] [--stream] [--profile]\n"
+	"                       [--format FORMAT] [--png-level N] [--fsync QUAND] FICHIER…\n"
+	"       receipt-scanner --compile [--binary|--dataset FICHIER] [--cache FICHIER] DOSSIER\n"
+	"       receipt-scanner --serve [--decode MODÈLE|--binary [--intern]] [--stream] [--profile]\n"
 	"       receipt-scanner --help\n"
 ;
 
@@ -31,6 +68,28 @@ static const char* help =
 	"       --scan          Sort le contenu du reçu sous forme textuelle.\n"
 	"       --extract       Extrait chaque lettre du reçu en image indivuelle.\n"
 	"       --compile       Compile une collection d’échantillons en CSV.\n"
+	"       --serve         Traite en continu les requêtes lues sur l’entrée standard.\n"
+	"       --decode MODÈLE Reconnait les lettres de --scan avec le modèle donné.\n"
+	"       --binary        Écrit les features en trames binaires plutôt qu’en texte.\n"
+	"       --intern        N’écrit qu’une fois les features de chaque forme de lettre.\n"
+	"       --cache FICHIER Garde les features de --compile dans ce fichier.\n"
+	"       --dataset FICHIER\n"
+	"                       Écrit les échantillons de --compile dans ce jeu de données.\n"
+	"       --format FORMAT Enregistre les images en png, webp ou pgm.\n"
+	"       --png-level N   Compresse les PNG au niveau N, de 0 à 9.\n"
+	"       --fsync QUAND   Synchronise les images sur le disque : none, file ou end.\n"
+	"       --jobs N        Traite jusqu’à N fichiers en parallèle.\n"
+	"       --detect-scale N\n"
+	"                       Détecte les reçus sur la photo réduite N fois.\n"
+	"       --max-memory MIO\n"
+	"                       Limite la mémoire de travail de la détection à MIO Mio.\n"
+	"       --threshold MÉTHODE\n"
+	"                       Choisit le seuil de saturation par search ou histogram.\n"
+	"       --segment MOTEUR\n"
+	"                       Découpe les lignes et les lettres avec contours, components\n"
+	"                       ou projection.\n"
+	"       --stream        Écrit chaque reçu scanné dès qu’il est prêt.\n"
+	"       --profile       Écrit les mesures de chaque fichier sur la sortie d’erreur.\n"
 	"       --help          Affiche cette aide.\n"
 	"\n"
 	"Le mode par défaut est --cut --scan, qui a pour effet d’écrire sur la sortie\n"
@@ -40,10 +99,99 @@ static const char* help =
 	"en extrait le texte. --extract reçoit des reçus et en extrait les morceaux\n"
 	"d’images utilisés pour la reconnaissance de lettres. Combiner --cut aux autres\n"
 	"modes permet d’opérer sur des photos plutôt que des reçus déjà extraits.\n"
+	"Le FICHIER « - » désigne une image encodée lue sur l’entrée standard.\n"
 	"\n"
 	"--compile reçoit un dossier dont le nom de chaque sous-dossier sert d’étiquette\n"
-	"et dans lesquels chaque fichier est une image échantillon. Ces échantillons\n"
-	"sous compilés en CSV, écrit sur la sortie standard.\n"
+	"et dans lesquels chaque fichier est une image échantillon, en PNG, WebP ou\n"
+	"PGM comme les écrit --extract selon --format. Ces échantillons\n"
+	"sous compilés en CSV, écrit sur la sortie standard, dans l’ordre des chemins.\n"
+	"Avec --cache, seuls les échantillons nouveaux ou modifiés depuis le précédent\n"
+	"--compile sont décodés, d’après leur date de modification et leur taille.\n"
+	"Avec --dataset, les échantillons sont écrits dans un fichier binaire que\n"
+	"kakeibo.classifier --dataset projette directement en mémoire.\n"
+	"\n"
+	"--serve reste résident et lit sur l’entrée standard une requête par ligne, de\n"
+	"la forme « MODE FICHIER » ou « MODE - TAILLE ». MODE vaut cut, scan ou\n"
+	"extract, et s’applique à une photo comme avec --cut. Avec « - TAILLE », les\n"
+	"TAILLE octets suivant la ligne contiennent l’image encodée, de 256 Mio au\n"
+	"plus. La sortie de chaque requête est suivie d’une ligne « . », même si elle\n"
+	"a échoué : l’erreur est alors écrite sur la sortie d’erreur. La ligne « quit »\n"
+	"ou la fin de l’entrée arrête le service.\n"
+	"\n"
+	"--decode charge un modèle exporté par kakeibo.classifier --export. --scan sort\n"
+	"alors le texte reconnu plutôt que les features, comme kakeibo.classifier\n"
+	"--decode.\n"
+	"\n"
+	"--binary remplace la sortie textuelle de --scan et --compile par une suite de\n"
+	"trames : un octet de type, une taille sur 4 octets petit-boutistes, puis le\n"
+	"contenu. Une trame L contient une ligne de texte, soit 64 octets de features\n"
+	"(de 0 à 9) par lettre. Une trame R vide marque la fin d’un reçu. Une trame S\n"
+	"contient un échantillon de --compile : 64 octets de features, puis l’étiquette\n"
+	"et le chemin séparés par un octet nul. Avec --serve, la fin de chaque requête\n"
+	"est marquée par une trame . vide plutôt que par une ligne.\n"
+	"\n"
+	"--intern remplace les trames L de --binary, les mêmes lettres revenant sans\n"
+	"cesse sur un reçu. Chaque reçu commence par une trame D contenant les 64\n"
+	"octets de features de chaque forme de lettre distincte du reçu. Chaque ligne\n"
+	"est ensuite une trame I contenant, pour chaque lettre, le numéro de sa forme\n"
+	"dans la trame D sur 4 octets petit-boutistes. Il suffit alors de reconnaitre\n"
+	"chaque forme une fois.\n"
+	"\n"
+	"Les images de --cut et --extract sont encodées et écrites dans extracted/ par\n"
+	"un thread dédié, pendant que le traitement continue. --format png, le défaut,\n"
+	"est réglable par --png-level : 0 n’est pas compressé, 9 l’est au maximum.\n"
+	"webp encode sans perte, et pgm n’encode pas du tout, en PPM pour les images\n"
+	"en couleur. Avec --fsync file, chaque image est synchronisée sur le disque\n"
+	"dès son écriture, avec end, toutes le sont à la fin. Avec --serve, les images\n"
+	"d’une requête sont écrites, et synchronisées avec end, avant sa ligne « . ».\n"
+	"Les noms de fichier qu’écrit --cut seul sont donc ceux d’images qui peuvent\n"
+	"ne pas encore exister : elles le sont toutes à la fin du programme, ou de la\n"
+	"requête avec --serve.\n"
+	"\n"
+	"--stream écrit et vide le tampon de sortie après chaque reçu, plutôt qu’une\n"
+	"fois toute la photo traitée, et termine chaque reçu par une ligne vide. Les\n"
+	"reçus d’une photo restent dans l’ordre : chacun est écrit dès que lui et ceux\n"
+	"qui le précèdent sont prêts. En binaire, la trame R marque déjà la fin.\n"
+	"\n"
+	"--jobs ne change pas la sortie : les résultats sont écrits et numérotés dans\n"
+	"l’ordre des fichiers d’entrée.\n"
+	"\n"
+	"--detect-scale cherche les reçus sur une version réduite de la photo, puis\n"
+	"n’affine les coins qu’en pleine résolution avant de découper. 4 convient aux\n"
+	"photos de téléphone, et le défaut 1 détecte en pleine résolution. Avec 2, 4\n"
+	"ou 8, les JPEG sont décodés directement en réduit pour la détection, et la\n"
+	"pleine résolution n’est décodée que si la photo contient des reçus.\n"
+	"\n"
+	"--max-memory borne la mémoire de travail de la détection, en plus de la photo\n"
+	"décodée : la conversion HSV se fait par bandes, et les seuils de saturation\n"
+	"sont essayés un par un si leurs masques ne tiennent pas ensemble. Les reçus\n"
+	"trouvés sont exactement les mêmes. Si même un masque ne tient pas, environ 3\n"
+	"octets par pixel, la détection se fait sur la photo réduite jusqu’à 16 fois,\n"
+	"comme avec un --detect-scale plus grand. Combiné à --detect-scale, la photo\n"
+	"elle-même n’est décodée en pleine résolution qu’une fois les reçus trouvés.\n"
+	"La mémoire de travail est libérée après chaque photo plutôt que gardée pour\n"
+	"la suivante, ce qui borne aussi celle de --serve et --jobs.\n"
+	"\n"
+	"--threshold choisit comment est trouvé le seuil de saturation qui distingue\n"
+	"les reçus du fond. search, le défaut, essaie trois seuils et garde le meilleur\n"
+	"résultat. histogram déduit le seuil de l’histogramme de la photo, et ne revient\n"
+	"à search que si les reçus trouvés sont douteux.\n"
+	"\n"
+	"--segment choisit comment les lignes et les lettres sont découpées. contours,\n"
+	"le défaut, ferme l’image puis cherche les contours de chaque ligne, puis de\n"
+	"chaque lettre. components étiquette les composantes connexes en une seule\n"
+	"passe et les regroupe en lignes et en lettres. projection trouve les lignes\n"
+	"d’après la quantité d’encre de chaque ligne de pixels, en ne réestimant la\n"
+	"pente que des lignes qui semblent de travers.\n"
+	"\n"
+	"--profile écrit sur la sortie d’erreur un objet JSON par fichier ou requête,\n"
+	"sur une ligne : la durée de chaque étape en millisecondes, cumulée sur les\n"
+	"reçus de la photo, et des compteurs comme les contours trouvés, rejetés, les\n"
+	"lignes fusionnées, les lettres ignorées comme bruit et les lettres émises.\n"
+	"process_peak_rss_mb est le pic de mémoire résidente du processus depuis son\n"
+	"lancement, et non celui du seul fichier.\n"
+	"saturation_threshold est le seuil retenu pour la détection, et\n"
+	"detection_passes le nombre de seuils essayés pour le trouver.\n"
 ;
 
 static struct option options[] = {
@@ -51,6 +199,22 @@ static struct option options[] = {
 	{ "scan", no_argument, 0, 's' },
 	{ "extract", no_argument, 0, 'x' },
 	{ "compile", no_argument, 0, 'C' },
+	{ "serve", no_argument, 0, 'S' },
+	{ "decode", required_argument, 0, 'd' },
+	{ "binary", no_argument, 0, 'b' },
+	{ "intern", no_argument, 0, 'i' },
+	{ "cache", required_argument, 0, 'k' },
+	{ "dataset", required_argument, 0, 'T' },
+	{ "format", required_argument, 0, 'f' },
+	{ "png-level", required_argument, 0, 'z' },
+	{ "fsync", required_argument, 0, 'y' },
+	{ "jobs", required_argument, 0, 'j' },
+	{ "detect-scale", required_argument, 0, 'D' },
+	{ "max-memory", required_argument, 0, 'M' },
+	{ "threshold", required_argument, 0, 'H' },
+	{ "segment", required_argument, 0, 'G' },
+	{ "stream", no_argument, 0, 'w' },
+	{ "profile", no_argument, 0, 'p' },
 	{ "explain", no_argument, 0, 'e' },
 	{ "help", no_argument, 0, 'h' },
 	{}
@@ -64,32 +228,518 @@ static void bad_usage(const char* message = nullptr)
 	std::exit(2);
 }
 
+/**
+ * Résultat du traitement d’une image d’entrée. Rien n’est écrit pendant le
+ * traitement, pour que les images traitées en parallèle avec --jobs puissent
+ * être écrites dans l’ordre des fichiers d’entrée, et numérotées dans cet ordre
+ * par save.
+ */
+struct image_output {
+	std::vector<std::string> receipts; // Sortie de --scan, un texte par reçu.
+	std::vector<cv::Mat> images; // Images à enregistrer pour --cut et --extract.
+	std::string error;
+	std::string profile; // Enregistrement JSON de --profile.
+};
+
+/**
+ * Exécute scan_receipt en capturant sa sortie.
+ */
+static std::string scan_to_string(cv::Mat receipt)
+{
+	char* buffer = nullptr;
+	size_t size = 0;
+	std::FILE* stream = open_memstream(&buffer, &size);
+	scan_receipt(receipt, model ? &*model : nullptr, stream);
+	std::fclose(stream);
+	std::string text(buffer, size);
+	std::free(buffer);
+	return text;
+}
+
+static bool first_receipt = true;
+
+/**
+ * Écrit le texte d’un reçu scanné. Les reçus sont séparés d’une ligne vide.
+ * Avec --stream, chaque reçu est au contraire terminé par une ligne vide, pour
+ * que le lecteur sache qu’il est complet sans attendre le suivant, et la
+ * sortie est vidée aussitôt.
+ */
+static void write_receipt(const std::string& receipt)
+{
+	if (streaming) {
+		std::fwrite(receipt.data(), 1, receipt.size(), stdout);
+		if (!binary_output)
+			std::putchar('\n');
+		std::fflush(stdout);
+		return;
+	}
+
+	if (!first_receipt && !binary_output)
+		std::putchar('\n');
+	std::fwrite(receipt.data(), 1, receipt.size(), stdout);
+	first_receipt = false;
+}
+
 /**
  * Reçoit l’image d’un reçu et le traite selon le mode choisi par
  * l’utilisateur. Si --cut est passé, on reçoit chaque reçu pré-découpé.
  * Autrement, on reçoit l’image d’entrée.
  */
-static void process_receipt(cv::Mat receipt)
+static void process_receipt(cv::Mat receipt, image_output& output)
 {
-	static bool first_receipt = true;
-
 	switch(mode) {
 	case 'c':
-		std::puts(save(receipt).c_str());
+		output.images.push_back(receipt);
 		break;
 
 	case 's':
-		if (!first_receipt)
-			puts(""); // Sépare les reçus d’une ligne vide.
-		scan_receipt(receipt);
+		output.receipts.push_back(scan_to_string(receipt));
 		break;
 
 	case 'x':
-		extract_letters(receipt);
+		for (cv::Mat& letter : extract_letters(receipt))
+			output.images.push_back(letter);
 		break;
 	}
+}
 
-	first_receipt = false;
+/**
+ * Découpe les reçus détectés sur la photo et les traite. Chacun passe
+ * indépendamment par le découpage puis le traitement du mode choisi, en
+ * parallèle des autres reçus de la photo. Les résultats sont remis dans
+ * l’ordre de receipts. Avec --explain, on reste séquentiel pour que
+ * l’affichage se fasse dans l’ordre.
+ *
+ * Avec --stream, les reçus scannés sont écrits ici plutôt que par
+ * write_output, chacun dès que lui et ceux qui le précèdent sont prêts.
+ */
+static void process_receipts(cv::Mat source, const std::vector<quad>& receipts, image_output& output)
+{
+	std::vector<image_output> outputs(receipts.size());
+	std::mutex mutex;
+	std::vector<bool> done(receipts.size());
+	size_t written = 0;
+	profile* image_profile = current_profile;
+	auto process_receipts = [&](const cv::Range& range) {
+		// Les threads d’OpenCV n’héritent pas du profil courant.
+		profile* thread_profile = current_profile;
+		current_profile = image_profile;
+		for (int i = range.start; i < range.end; ++i) {
+			process_receipt(cut_receipt(source, receipts[i], mode != 'c'), outputs[i]);
+			if (!streaming)
+				continue;
+
+			std::lock_guard lock(mutex);
+			done[i] = true;
+			for (; written < done.size() && done[written]; ++written) {
+				for (const std::string& receipt : outputs[written].receipts)
+					write_receipt(receipt);
+				outputs[written].receipts.clear();
+			}
+		}
+		current_profile = thread_profile;
+		if (memory_budget)
+			scratch().release();
+	};
+	if (explain || receipts.size() <= 1)
+		process_receipts(cv::Range(0, receipts.size()));
+	else
+		cv::parallel_for_(cv::Range(0, receipts.size()), process_receipts);
+
+	for (image_output& receipt : outputs) {
+		std::move(receipt.receipts.begin(), receipt.receipts.end(), std::back_inserter(output.receipts));
+		std::move(receipt.images.begin(), receipt.images.end(), std::back_inserter(output.images));
+	}
+}
+
+/**
+ * Traite une image d’entrée : découpe chaque reçu de la photo si --cut est
+ * actif, ou traite directement l’image comme un reçu sinon.
+ */
+static void process_image(cv::Mat source, image_output& output)
+{
+	if (cut)
+		process_receipts(source, find_receipts(source), output);
+	else
+		process_receipt(source, output);
+}
+
+/**
+ * Drapeau de cv::imread pour décoder directement l’image réduite scale fois.
+ * Les JPEG sont alors réduits pendant le décodage, bien plus vite qu’avec un
+ * décodage complet suivi d’un redimensionnement. Renvoie -1 si aucun drapeau
+ * ne correspond à scale.
+ */
+static int reduced_decode_flag(int scale)
+{
+	switch (scale) {
+	case 2: return cv::IMREAD_REDUCED_COLOR_2;
+	case 4: return cv::IMREAD_REDUCED_COLOR_4;
+	case 8: return cv::IMREAD_REDUCED_COLOR_8;
+	default: return -1;
+	}
+}
+
+/**
+ * Vrai si les données commencent par la signature d’un JPEG.
+ */
+static bool is_jpeg(const uchar* data, size_t size)
+{
+	return size >= 3 && data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff;
+}
+
+/**
+ * Vrai si le fichier est un JPEG, d’après ses premiers octets.
+ */
+static bool is_jpeg_file(const char* path)
+{
+	uchar header[3];
+	std::FILE* file = std::fopen(path, "rb");
+	if (!file)
+		return false;
+	size_t size = std::fread(header, 1, sizeof(header), file);
+	std::fclose(file);
+	return is_jpeg(header, size);
+}
+
+/**
+ * Décode et traite une image. decode reçoit les drapeaux de cv::imread et
+ * renvoie l’image décodée, ou une image vide si elle est illisible. Renvoie
+ * faux dans ce cas.
+ *
+ * Avec --cut, un --detect-scale de 2, 4 ou 8 et un JPEG, la détection se
+ * fait sur une image décodée directement en réduit. Cette image est libérée
+ * avant que la photo soit décodée en pleine résolution, et seulement si elle
+ * contient des reçus. Une photo n’occupe donc jamais plus que sa version
+ * réduite et ses masques, puis sa pleine résolution et les reçus découpés.
+ * Les autres formats sont décodés en entier puis réduits par OpenCV de toute
+ * façon : les décoder deux fois ne ferait que coûter plus cher, et ils
+ * passent par find_receipts. receipt-bench compare les deux chemins.
+ */
+static bool process_encoded(const std::function<cv::Mat(int)>& decode, bool jpeg, image_output& output)
+{
+	int reduced_flag = cut && jpeg ? reduced_decode_flag(detection_scale) : -1;
+	if (reduced_flag < 0) {
+		cv::Mat source;
+		{
+			stage_timer timer(STAGE_DECODE);
+			source = decode(cv::IMREAD_COLOR);
+		}
+		if (source.empty())
+			return false;
+		process_image(source, output);
+		return true;
+	}
+
+	receipt_detection detection;
+	{
+		cv::Mat reduced;
+		{
+			stage_timer timer(STAGE_DECODE);
+			reduced = decode(reduced_flag);
+		}
+		if (reduced.empty())
+			return false;
+		detection = detect_receipts(reduced, detection_scale);
+	}
+	if (detection.receipts.empty())
+		return true;
+
+	cv::Mat source;
+	{
+		stage_timer timer(STAGE_DECODE);
+		source = decode(cv::IMREAD_COLOR);
+	}
+	if (source.empty())
+		return false;
+	process_receipts(source, refine_receipts(source, detection), output);
+	return true;
+}
+
+/**
+ * Lit toute l’entrée standard, pour le fichier « - ». L’image qu’elle contient
+ * est ensuite décodée en mémoire, sans passer par un fichier.
+ */
+static std::vector<uchar> read_stdin()
+{
+	std::vector<uchar> buffer;
+	uchar chunk[65536];
+	size_t size;
+	while ((size = std::fread(chunk, 1, sizeof(chunk), stdin)) > 0)
+		buffer.insert(buffer.end(), chunk, chunk + size);
+	return buffer;
+}
+
+/**
+ * Charge et traite un fichier d’entrée. Les erreurs sont consignées dans le
+ * résultat pour être signalées à leur tour.
+ */
+static image_output process_file(const char* image_path)
+{
+	image_output output;
+	std::optional<profile> file_profile;
+	if (profiling) {
+		file_profile.emplace();
+		current_profile = &*file_profile;
+	}
+	auto start = std::chrono::steady_clock::now();
+
+	// L’entrée standard ne peut être lue qu’une fois, donc on garde son
+	// contenu pour le décoder à chaque résolution.
+	std::vector<uchar> input;
+	bool from_stdin = std::strcmp(image_path, "-") == 0;
+	if (from_stdin)
+		input = read_stdin();
+	auto decode = [&](int flags) {
+		if (from_stdin)
+			return input.empty() ? cv::Mat() : cv::imdecode(input, flags);
+		return cv::imread(image_path, flags);
+	};
+
+	try {
+		bool jpeg = from_stdin ? is_jpeg(input.data(), input.size()) : is_jpeg_file(image_path);
+		if (!process_encoded(decode, jpeg, output))
+			output.error = std::string("Image illisible : ") + image_path;
+	} catch (const cv::Exception& e) {
+		output.error = std::string("Échec du traitement de ") + image_path + " : " + e.what();
+	}
+	if (memory_budget)
+		scratch().release();
+
+	if (file_profile) {
+		file_profile->wall = (std::chrono::steady_clock::now() - start).count();
+		output.profile = file_profile->to_json(image_path);
+		current_profile = nullptr;
+	}
+	return output;
+}
+
+/**
+ * Écrit le résultat d’une image. Les reçus scannés sont séparés d’une ligne
+ * vide, et les images sont enregistrées dans extracted/. Avec --cut seul, on
+ * écrit le nom de chaque fichier enregistré.
+ */
+static void write_output(const image_output& output)
+{
+	if (!output.error.empty())
+		std::fprintf(stderr, "%s\n", output.error.c_str());
+	if (!output.profile.empty())
+		std::fprintf(stderr, "%s\n", output.profile.c_str());
+
+	for (const std::string& receipt : output.receipts)
+		write_receipt(receipt);
+
+	for (const cv::Mat& image : output.images) {
+		std::string output_file = save(image);
+		if (mode == 'c')
+			std::puts(output_file.c_str());
+	}
+}
+
+/**
+ * Traite les fichiers sur jobs threads. Chaque thread prend le prochain
+ * fichier à traiter, tandis que le thread principal écrit les résultats dans
+ * l’ordre des fichiers au fur et à mesure qu’ils sont prêts. Pour borner la
+ * mémoire, les threads ne prennent pas plus de 2 × jobs fichiers d’avance sur
+ * l’écriture.
+ */
+static void process_files(const std::vector<const char*>& files, int jobs)
+{
+	if (jobs <= 1) {
+		for (const char* image_path : files)
+			write_output(process_file(image_path));
+		return;
+	}
+
+	struct slot {
+		bool done = false;
+		image_output output;
+	};
+	std::vector<slot> slots(files.size());
+	size_t next = 0; // Prochain fichier à traiter.
+	size_t written = 0; // Nombre de résultats déjà écrits.
+	std::mutex mutex;
+	std::condition_variable done;
+	std::condition_variable progress;
+
+	auto worker = [&]() {
+		for (;;) {
+			size_t index;
+			{
+				std::unique_lock lock(mutex);
+				progress.wait(lock, [&] {
+					return next >= files.size() || next < written + 2 * jobs;
+				});
+				if (next >= files.size())
+					return;
+				index = next++;
+			}
+
+			image_output output = process_file(files[index]);
+			{
+				std::lock_guard lock(mutex);
+				slots[index].output = std::move(output);
+				slots[index].done = true;
+			}
+			done.notify_all();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < jobs; ++i)
+		threads.emplace_back(worker);
+
+	for (size_t i = 0; i < files.size(); ++i) {
+		image_output output;
+		{
+			std::unique_lock lock(mutex);
+			done.wait(lock, [&] { return slots[i].done; });
+			output = std::move(slots[i].output);
+			written = i + 1;
+		}
+		progress.notify_all();
+		write_output(output);
+	}
+
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+/** Taille maximale d’une image encodée transmise à --serve. */
+static const size_t max_blob_size = size_t(256) << 20;
+
+/**
+ * Lit dans blob une image encodée sur l’entrée standard, dont la taille en
+ * octets est écrite en décimal dans size. Renvoie un message d’erreur si la
+ * taille est invalide ou si les données sont tronquées. Une image de plus de
+ * max_blob_size octets est lue sans être gardée, pour que la requête suivante
+ * soit lue au bon endroit.
+ */
+static std::string read_blob(const std::string& size, std::vector<uchar>& blob)
+{
+	char* end;
+	errno = 0;
+	unsigned long long length = std::strtoull(size.c_str(), &end, 10);
+	if (size.empty() || size[0] < '0' || size[0] > '9' || *end || errno == ERANGE)
+		return "Taille invalide : " + size;
+
+	if (length > max_blob_size) {
+		char discarded[65536];
+		while (length > 0) {
+			size_t skipped = std::fread(discarded, 1, std::min<unsigned long long>(length, sizeof(discarded)), stdin);
+			if (skipped == 0)
+				break;
+			length -= skipped;
+		}
+		return "Image trop grande : " + size + " octets";
+	}
+
+	blob.resize(length);
+	if (std::fread(blob.data(), 1, length, stdin) != length) {
+		blob.clear();
+		return "Image tronquée";
+	}
+	return {};
+}
+
+/**
+ * Traite une requête de --serve, de la forme « MODE FICHIER » ou
+ * « MODE - TAILLE ». Les erreurs, y compris d’allocation, sont signalées sur
+ * la sortie d’erreur et la requête n’a alors aucun résultat, sans interrompre
+ * le service.
+ */
+static void serve_request(const std::string& request)
+{
+	size_t space = request.find(' ');
+	std::string job_mode = request.substr(0, space);
+	std::string source = space == std::string::npos ? "" : request.substr(space + 1);
+
+	if (job_mode == "cut")
+		mode = 'c';
+	else if (job_mode == "scan")
+		mode = 's';
+	else if (job_mode == "extract")
+		mode = 'x';
+	else {
+		std::fprintf(stderr, "Requête invalide : %s\n", request.c_str());
+		return;
+	}
+
+	std::optional<profile> request_profile;
+	if (profiling) {
+		request_profile.emplace();
+		current_profile = &*request_profile;
+	}
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<uchar> blob;
+	bool from_blob = source.starts_with("- ");
+	auto decode = [&](int flags) {
+		if (from_blob)
+			return blob.empty() ? cv::Mat() : cv::imdecode(blob, flags);
+		return source.empty() ? cv::Mat() : cv::imread(source, flags);
+	};
+
+	image_output output;
+	try {
+		if (from_blob) {
+			stage_timer timer(STAGE_DECODE);
+			output.error = read_blob(source.substr(2), blob);
+		}
+		bool jpeg = from_blob ? is_jpeg(blob.data(), blob.size()) : is_jpeg_file(source.c_str());
+		if (output.error.empty() && !process_encoded(decode, jpeg, output))
+			output.error = "Image illisible : " + source;
+	} catch (const std::exception& e) {
+		output.error = std::string("Échec du traitement : ") + e.what();
+		output.receipts.clear();
+		output.images.clear();
+	}
+	if (memory_budget)
+		scratch().release();
+
+	if (request_profile) {
+		request_profile->wall = (std::chrono::steady_clock::now() - start).count();
+		output.profile = request_profile->to_json(source);
+		current_profile = nullptr;
+	}
+	first_receipt = true;
+	write_output(output);
+}
+
+/**
+ * Boucle principale de --serve. Chaque requête est lue sur l’entrée standard
+ * et sa sortie est terminée par une ligne « . », puis vidée immédiatement
+ * pour que le client puisse lire la réponse sans attendre la suivante.
+ */
+static void serve_requests()
+{
+	char* line = nullptr;
+	size_t capacity = 0;
+	ssize_t length;
+	while ((length = getline(&line, &capacity, stdin)) != -1) {
+		std::string request(line, length);
+		if (request.ends_with('\n'))
+			request.pop_back();
+		if (request == "quit")
+			break;
+		if (request.empty())
+			continue;
+
+		try {
+			serve_request(request);
+		} catch (const std::exception& e) {
+			current_profile = nullptr;
+			std::fprintf(stderr, "Échec de la requête %s : %s\n", request.c_str(), e.what());
+		}
+		// Le client peut lire les images dès qu’il a reçu la fin de requête.
+		flush_images();
+		if (binary_output)
+			write_frame(stdout, '.', nullptr, 0);
+		else
+			std::puts(".");
+		std::fflush(stdout);
+	}
+	std::free(line);
 }
 
 int main(int argc, char** argv)
@@ -109,6 +759,94 @@ int main(int argc, char** argv)
 				bad_usage("Le mode ne peut être spécifié qu’une fois.\n");
 			mode = c;
 			break;
+		case 'S':
+			serve = true;
+			break;
+		case 'd':
+			model = load_svm_model(optarg);
+			if (!model) {
+				std::fprintf(stderr, "Modèle illisible : %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'b':
+			binary_output = true;
+			break;
+		case 'i':
+			interned_output = true;
+			break;
+		case 'k':
+			cache_path = optarg;
+			break;
+		case 'T':
+			dataset_path = optarg;
+			break;
+		case 'f':
+			if (std::strcmp(optarg, "png") == 0)
+				output_format = FORMAT_PNG;
+			else if (std::strcmp(optarg, "webp") == 0)
+				output_format = FORMAT_WEBP;
+			else if (std::strcmp(optarg, "pgm") == 0)
+				output_format = FORMAT_PNM;
+			else
+				bad_usage("--format attend png, webp ou pgm.\n");
+			break;
+		case 'z':
+			png_level = std::atoi(optarg);
+			if (png_level < 0 || png_level > 9)
+				bad_usage("--png-level attend un nombre de 0 à 9.\n");
+			break;
+		case 'y':
+			if (std::strcmp(optarg, "none") == 0)
+				output_sync = SYNC_NONE;
+			else if (std::strcmp(optarg, "file") == 0)
+				output_sync = SYNC_FILE;
+			else if (std::strcmp(optarg, "end") == 0)
+				output_sync = SYNC_END;
+			else
+				bad_usage("--fsync attend none, file ou end.\n");
+			break;
+		case 'j':
+			jobs = std::atoi(optarg);
+			if (jobs < 1)
+				bad_usage("--jobs attend un nombre positif.\n");
+			break;
+		case 'D':
+			detection_scale = std::atoi(optarg);
+			if (detection_scale < 1)
+				bad_usage("--detect-scale attend un nombre positif.\n");
+			break;
+		case 'M': {
+			int megabytes = std::atoi(optarg);
+			if (megabytes < 1)
+				bad_usage("--max-memory attend un nombre positif.\n");
+			memory_budget = size_t(megabytes) << 20;
+			break;
+		}
+		case 'H':
+			if (std::strcmp(optarg, "search") == 0)
+				saturation_strategy = THRESHOLD_SEARCH;
+			else if (std::strcmp(optarg, "histogram") == 0)
+				saturation_strategy = THRESHOLD_HISTOGRAM;
+			else
+				bad_usage("--threshold attend search ou histogram.\n");
+			break;
+		case 'G':
+			if (std::strcmp(optarg, "contours") == 0)
+				segmentation = SEGMENT_CONTOURS;
+			else if (std::strcmp(optarg, "components") == 0)
+				segmentation = SEGMENT_COMPONENTS;
+			else if (std::strcmp(optarg, "projection") == 0)
+				segmentation = SEGMENT_PROJECTION;
+			else
+				bad_usage("--segment attend contours, components ou projection.\n");
+			break;
+		case 'w':
+			streaming = true;
+			break;
+		case 'p':
+			profiling = true;
+			break;
 		case 'e':
 			explain = true;
 			break;
@@ -121,6 +859,27 @@ int main(int argc, char** argv)
 		}
 	}
 
+	if (binary_output && model)
+		bad_usage("--binary et --decode sont incompatibles.\n");
+	if (interned_output && !binary_output)
+		bad_usage("--intern n’est utilisable qu’avec --binary.\n");
+	if ((cache_path || dataset_path) && mode != 'C')
+		bad_usage("--cache et --dataset ne sont utilisables qu’avec --compile.\n");
+	if (dataset_path && binary_output)
+		bad_usage("--binary et --dataset sont incompatibles.\n");
+	if (jobs > 1 && (explain || serve || streaming))
+		bad_usage("--jobs n’est compatible ni avec --explain, ni avec --serve, ni avec --stream.\n");
+
+	if (serve) {
+		if (mode != 0 || cut)
+			bad_usage("--serve choisit le mode à chaque requête.\n");
+		if (optind != argc)
+			bad_usage("--serve lit ses requêtes sur l’entrée standard.\n");
+		cut = true;
+		serve_requests();
+		return close_images() ? 0 : 1;
+	}
+
 	// En l’absence de mode, si --cut est spécifié on utilise le mode
 	// cut-only. Sinon, on utilise le mode cut-scan.
 	if (mode == 0) {
@@ -139,16 +898,7 @@ int main(int argc, char** argv)
 		if (optind == argc)
 			bad_usage("Aucun fichier à traiter.\n");
 
-		for (int argi = optind; argi < argc; ++argi) {
-			const char* image_path = argv[argi];
-			cv::Mat source = cv::imread(image_path, cv::IMREAD_COLOR);
-			if (cut) {
-				for (auto contour : find_receipts(source))
-					process_receipt(cut_receipt(source, contour));
-			} else {
-				process_receipt(source);
-			}
-		}
+		process_files(std::vector<const char*>(argv + optind, argv + argc), jobs);
 		break;
 
 	case 'C':
@@ -157,31 +907,75 @@ int main(int argc, char** argv)
 		else if (argc - optind > 1)
 			bad_usage("Trop d’arguments.\n");
 
-		compile_features(argv[optind]);
+		if (!compile_features(argv[optind], cache_path, dataset_path))
+			return 1;
 		break;
 	}
 
-	return 0;
+	return close_images() ? 0 : 1;
+}
+
+/**
+ * Écrit une trame binaire pour --binary : le type sur
+ * un octet, la taille du contenu sur 4 octets petit-boutistes, puis le contenu.
+ */
+void write_frame(std::FILE* output, char type, const void* data, size_t size)
+{
+	unsigned char header[5] = {
+		static_cast<unsigned char>(type),
+		static_cast<unsigned char>(size),
+		static_cast<unsigned char>(size >> 8),
+		static_cast<unsigned char>(size >> 16),
+		static_cast<unsigned char>(size >> 24),
+	};
+	std::fwrite(header, 1, sizeof(header), output);
+	if (size)
+		std::fwrite(data, 1, size, output);
 }
 
 /**
- * Enregistre l’image dans un fichier extracted/0123.png. Renvoie le nom du
- * fichier de sortie.
+ * Formate le profil en objet JSON sur une ligne, pour --profile.
  */
-std::string save(cv::Mat image)
+std::string profile::to_json(const std::string& file) const
 {
-	static bool extracted_directory_created = false;
-	if (!extracted_directory_created) {
-		std::filesystem::create_directories("extracted");
-		extracted_directory_created = true;
+	static const char* stage_names[STAGE_COUNT] = {
+		"decode", "detect", "warp", "binarize", "segment", "features",
+	};
+	static const char* counter_names[COUNTER_COUNT] = {
+		"contours", "not_rectangles", "too_small", "too_wide", "receipts",
+		"saturation_threshold", "detection_passes",
+		"noise_lines", "merged_lines", "noise_letters", "letters", "distinct_letters",
+	};
+
+	std::string json = "{\"file\": \"";
+	for (char c : file) {
+		if (c == '"' || c == '\\')
+			json.push_back('\\');
+		if (static_cast<unsigned char>(c) >= 0x20)
+			json.push_back(c);
 	}
+	json += '"';
 
-	static int extracted_count = 0;
-	char buffer[32];
-	std::snprintf(buffer, 32, "extracted/%04d.png", ++extracted_count);
-	std::string output_file = buffer;
-	cv::imwrite(output_file, image);
-	return output_file;
+	char buffer[64];
+	std::snprintf(buffer, sizeof(buffer), ", \"wall_ms\": %.3f", wall / 1e6);
+	json += buffer;
+	// Maximum depuis le lancement du processus. Sous Linux, ru_maxrss est en
+	// kilooctets.
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		std::snprintf(buffer, sizeof(buffer), ", \"process_peak_rss_mb\": %.1f", usage.ru_maxrss / 1024.);
+		json += buffer;
+	}
+	for (int i = 0; i < STAGE_COUNT; ++i) {
+		std::snprintf(buffer, sizeof(buffer), ", \"%s_ms\": %.3f", stage_names[i], stages[i] / 1e6);
+		json += buffer;
+	}
+	for (int i = 0; i < COUNTER_COUNT; ++i) {
+		std::snprintf(buffer, sizeof(buffer), ", \"%s\": %lld", counter_names[i], static_cast<long long>(counters[i]));
+		json += buffer;
+	}
+	json += '}';
+	return json;
 }
 
 /**
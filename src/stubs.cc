@@ -0,0 +1,16 @@
+/*
+ * Versions inertes des options et fonctions de receipt-scanner.cc et writer.cc
+ * dont dépendent cutter.cc et detector.cc, pour les cibles qui les utilisent
+ * sans receipt-scanner.cc : libkakeibo et receipt-bench. Pas de --explain, et
+ * aucune sortie.
+ */
+
+#include "kakeibo.h"
+
+bool explain = false;
+bool binary_output = false;
+bool interned_output = false;
+void show(const std::string&, cv::Mat) {}
+std::string save(cv::Mat) { return {}; }
+void write_frame(std::FILE*, char, const void*, size_t) {}
+thread_local profile* current_profile = nullptr;
@@ -0,0 +1,70 @@
+/*
+ * Mémoire de travail de la détection et du découpage.
+ *
+ * Sur un lot de photos, les mêmes étapes allouent et libèrent sans arrêt des
+ * images de tailles voisines : masques de chaque photo, extrait de chaque ligne
+ * de texte, etc. Le workspace garde ces images d’un appel à l’autre. Chaque
+ * tampon ne fait que grandir, par paliers, si bien qu’une fois la plus grande
+ * taille rencontrée, plus aucune allocation n’a lieu.
+ *
+ * Avec --max-memory, garder la plus grande taille rencontrée par chaque thread
+ * irait contre la limite en --serve et --jobs : le workspace est alors libéré
+ * après chaque photo par release.
+ */
+
+#include "kakeibo.h"
+
+#include <algorithm>
+
+/** Les dimensions des tampons sont arrondies à ce multiple. */
+static const int bucket_size = 64;
+
+static int round_up(int value)
+{
+	return (value + bucket_size - 1) / bucket_size * bucket_size;
+}
+
+/**
+ * Renvoie une image de la taille et du type demandés, vue sur le tampon slot.
+ * Son contenu est indéterminé. Elle reste valide jusqu’au prochain appel pour
+ * le même slot sur le même thread.
+ *
+ * Comme l’image a déjà la bonne taille, les fonctions d’OpenCV qui la
+ * reçoivent en sortie écrivent dedans sans réallouer.
+ */
+cv::Mat workspace::buffer(workspace_slot slot, cv::Size size, int type)
+{
+	cv::Mat& backing = buffers[slot];
+	if (backing.type() != type || backing.rows < size.height || backing.cols < size.width) {
+		int rows = round_up(size.height);
+		int cols = round_up(size.width);
+		if (backing.type() == type) {
+			rows = std::max(rows, backing.rows);
+			cols = std::max(cols, backing.cols);
+		}
+		backing.create(rows, cols, type);
+	}
+	return backing(cv::Rect(0, 0, size.width, size.height));
+}
+
+/**
+ * Libère les tampons d’image et les contours de la photo. Les images obtenues
+ * par buffer ne doivent plus servir.
+ */
+void workspace::release()
+{
+	for (cv::Mat& backing : buffers)
+		backing.release();
+	photo_contours.clear();
+	photo_contours.shrink_to_fit();
+}
+
+/**
+ * Renvoie le workspace du thread courant. Les threads de --jobs comme ceux de
+ * cv::parallel_for_ ont ainsi chacun le leur, sans verrou.
+ */
+workspace& scratch()
+{
+	thread_local workspace instance;
+	return instance;
+}
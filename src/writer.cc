@@ -0,0 +1,222 @@
+/*
+ * Enregistrement des images de --cut et --extract dans extracted/.
+ *
+ * L’encodage, surtout en PNG, coûte souvent plus cher que le traitement qui a
+ * produit l’image. save se contente donc de numéroter l’image et de la mettre
+ * dans une file, qu’un thread dédié encode et écrit sur le disque. La file est
+ * bornée pour que la mémoire reste sous contrôle si le disque ne suit pas.
+ */
+
+#include "kakeibo.h"
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/** Format des images enregistrées, choisi par --format. */
+image_format output_format = FORMAT_PNG;
+
+/** Niveau de compression PNG de --png-level, ou -1 pour celui d’OpenCV. */
+int png_level = -1;
+
+/** Moment où les images sont synchronisées sur le disque, choisi par --fsync. */
+sync_policy output_sync = SYNC_NONE;
+
+/** Nombre d’images en attente d’écriture au-delà duquel save bloque. */
+static const size_t queue_capacity = 64;
+
+struct pending_image {
+	std::string path;
+	cv::Mat image;
+};
+
+static std::mutex mutex;
+static std::condition_variable changed;
+static std::deque<pending_image> queue;
+static bool writing = false; // Une image sortie de la file est en cours d’écriture.
+static bool stopping = false;
+static bool failed = false;
+static std::thread writer;
+static std::vector<std::string> written; // Fichiers à synchroniser avec SYNC_END.
+
+static const char* extension(cv::Mat image)
+{
+	switch (output_format) {
+	case FORMAT_WEBP: return ".webp";
+	case FORMAT_PNM: return image.channels() == 1 ? ".pgm" : ".ppm";
+	default: return ".png";
+	}
+}
+
+static std::vector<int> encoding_parameters()
+{
+	switch (output_format) {
+	case FORMAT_WEBP:
+		// Une qualité au-delà de 100 demande l’encodage sans perte.
+		return { cv::IMWRITE_WEBP_QUALITY, 101 };
+	case FORMAT_PNM:
+		return { cv::IMWRITE_PXM_BINARY, 1 };
+	default:
+		if (png_level < 0)
+			return {};
+		return { cv::IMWRITE_PNG_COMPRESSION, png_level };
+	}
+}
+
+/**
+ * Force l’écriture sur le disque du fichier ou du dossier donné.
+ */
+static bool sync_path(const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	bool ok = fsync(fd) == 0;
+	close(fd);
+	return ok;
+}
+
+/**
+ * Synchronise les fichiers écrits depuis le dernier appel, puis le dossier.
+ * Appelée une fois la file vide, avec le verrou pris ou le thread d’écriture
+ * arrêté.
+ */
+static bool sync_written()
+{
+	bool ok = true;
+	for (const std::string& path : written)
+		ok = sync_path(path.c_str()) && ok;
+	written.clear();
+	// Les nouvelles entrées du dossier ne sont durables qu’une fois le
+	// dossier lui-même synchronisé.
+	if (std::filesystem::exists("extracted"))
+		ok = sync_path("extracted") && ok;
+	return ok;
+}
+
+/**
+ * Encode et écrit une image. Avec SYNC_FILE, le fichier est synchronisé avant
+ * d’être refermé.
+ */
+static bool write_image(const pending_image& pending)
+{
+	std::vector<uchar> encoded;
+	std::string path = pending.path;
+	if (!cv::imencode(path.substr(path.rfind('.')), pending.image, encoded, encoding_parameters()))
+		return false;
+
+	std::FILE* file = std::fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+	bool ok = std::fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+	ok = std::fflush(file) == 0 && ok;
+	if (output_sync == SYNC_FILE)
+		ok = fsync(fileno(file)) == 0 && ok;
+	return std::fclose(file) == 0 && ok;
+}
+
+static void write_images()
+{
+	std::unique_lock lock(mutex);
+	for (;;) {
+		changed.wait(lock, [] { return stopping || !queue.empty(); });
+		if (queue.empty())
+			return;
+
+		pending_image pending = std::move(queue.front());
+		queue.pop_front();
+		writing = true;
+		changed.notify_all();
+
+		lock.unlock();
+		bool ok = write_image(pending);
+		if (!ok)
+			std::fprintf(stderr, "Impossible d’écrire %s\n", pending.path.c_str());
+		lock.lock();
+
+		if (!ok)
+			failed = true;
+		else if (output_sync == SYNC_END)
+			written.push_back(std::move(pending.path));
+		writing = false;
+		changed.notify_all();
+	}
+}
+
+/**
+ * Enregistre l’image dans un fichier extracted/0123.png, ou avec l’extension
+ * du format choisi. Renvoie le nom du fichier de sortie, qui n’existe qu’après
+ * le prochain flush_images. La numérotation est protégée par un verrou, mais
+ * pour qu’elle suive l’ordre des entrées, les images sont enregistrées par
+ * write_output plutôt que pendant le traitement.
+ *
+ * L’image n’est pas copiée : l’appelant ne doit plus la modifier.
+ */
+std::string save(cv::Mat image)
+{
+	std::unique_lock lock(mutex);
+
+	static bool extracted_directory_created = false;
+	if (!extracted_directory_created) {
+		std::filesystem::create_directories("extracted");
+		extracted_directory_created = true;
+	}
+	if (!writer.joinable())
+		writer = std::thread(write_images);
+
+	static int extracted_count = 0;
+	char buffer[32];
+	std::snprintf(buffer, 32, "extracted/%04d%s", ++extracted_count, extension(image));
+	std::string output_file = buffer;
+
+	changed.wait(lock, [] { return queue.size() < queue_capacity; });
+	queue.push_back({ output_file, image });
+	changed.notify_all();
+	return output_file;
+}
+
+/**
+ * Attend que toutes les images passées à save soient écrites. Avec SYNC_END,
+ * elles sont alors synchronisées : pour --serve, la fin de chaque requête est
+ * la fin de ses images, et la liste des fichiers à synchroniser ne grandit
+ * pas tant que le service dure.
+ */
+void flush_images()
+{
+	std::unique_lock lock(mutex);
+	changed.wait(lock, [] { return queue.empty() && !writing; });
+	if (output_sync != SYNC_NONE && !sync_written())
+		failed = true;
+}
+
+/**
+ * Écrit les dernières images et arrête le thread d’écriture. Avec SYNC_END,
+ * synchronise alors tous les fichiers écrits. Renvoie faux si une image n’a
+ * pas pu être écrite.
+ */
+bool close_images()
+{
+	{
+		std::lock_guard lock(mutex);
+		stopping = true;
+	}
+	changed.notify_all();
+	if (!writer.joinable())
+		return true;
+	writer.join();
+
+	bool ok = !failed;
+	if (output_sync != SYNC_NONE)
+		ok = sync_written() && ok;
+	if (!ok)
+		std::fputs("Les images n’ont pas toutes été enregistrées.\n", stderr);
+	return ok;
+}
@@ -0,0 +1,167 @@
+#!/usr/bin/perl
+
+# Mesure le débit et la précision de receipt-scanner sur les photos de t/,
+# nommées comme pour check.t : {DATE}Y{TOTAL}+….jpg. Il doit être exécuté
+# depuis la racine du projet, avec le chemin de receipt-scanner en argument.
+# CTest le lance ainsi sous le nom corpus.
+#
+# On mesure les photos et les reçus par seconde, ainsi que la latence par photo
+# (p50 et p99) donnée par --profile. Sans letters.svm, le texte n’est pas
+# reconnu, et seule la détection est vérifiée : autant de reçus que de
+# {DATE}Y{TOTAL} dans le nom. Avec le modèle, chaque date et total doit en plus
+# être lu.
+#
+# Les mesures sont comparées à la référence dont le chemin est donné en second
+# argument, build/corpus.baseline par défaut, et que CTest place dans le
+# dossier de compilation. Le test échoue si le débit baisse de plus de
+# KAKEIBO_TOLERANCE pourcents (20 par défaut), ou si la précision baisse. Les
+# débits dépendent de la machine : la référence doit être enregistrée sur
+# celle qui lance les tests, en définissant KAKEIBO_UPDATE_BASELINE.
+#
+# Sans photo dans t/, ou sans référence, le test est sauté avec le code 77,
+# que CTest affiche comme tel plutôt que comme une réussite.
+
+use strict;
+use warnings;
+use utf8;
+
+use File::Temp qw(tempfile);
+use JSON::PP;
+use POSIX qw(ceil);
+use Test::More;
+use Time::HiRes qw(time);
+
+binmode Test::More->builder->$_, ':encoding(UTF-8)' for qw(output failure_output);
+
+my $scanner = shift @ARGV // './receipt-scanner';
+my $baseline_path = shift @ARGV // 'build/corpus.baseline';
+my $tolerance = ($ENV{KAKEIBO_TOLERANCE} // 20) / 100;
+my $updating = $ENV{KAKEIBO_UPDATE_BASELINE};
+
+sub skip_corpus {
+	my ($reason) = @_;
+	my $builder = Test::More->builder;
+	$builder->no_ending(1);
+	print { $builder->output } "1..0 # SKIP $reason\n";
+	exit 77;
+}
+
+my @photos = sort <t/*.jpg>;
+skip_corpus 'aucune photo dans t/, le corpus n’est pas mesuré.' unless @photos;
+skip_corpus "pas de référence $baseline_path : relancer avec KAKEIBO_UPDATE_BASELINE=1 pour l’enregistrer."
+	unless $updating || -e $baseline_path;
+
+# Reçus attendus de chaque photo, d’après son nom.
+my %wanted;
+for my $photo (@photos) {
+	(my $name = $photo) =~ s{^.*/|\..*$}{}g;
+	$wanted{$photo} = [grep { defined } map { /^(\d+-\d+-\d+)Y(\d+)$/ ? "$1\t$2" : undef } split /\+/, $name];
+}
+
+my @options = ('--stream', '--profile');
+my $decoding = -e 'letters.svm';
+push @options, '--decode', 'letters.svm' if $decoding;
+
+my (undef, $profile_path) = tempfile(UNLINK => 1);
+my $start = time;
+open my $output, '-|', join ' ', map({ quotemeta } $scanner, @options, '--', @photos), "2>$profile_path"
+	or die "Impossible de lancer $scanner : $!";
+binmode $output, ':encoding(UTF-8)';
+# Avec --stream, chaque reçu se termine par une ligne vide.
+my @receipts = ('');
+while (my $line = <$output>) {
+	if ($line eq "\n") {
+		push @receipts, '';
+	} else {
+		$receipts[-1] .= $line;
+	}
+}
+pop @receipts;
+close $output;
+my $elapsed = time - $start;
+is $?, 0, "$scanner se termine sans erreur";
+
+open my $profile_file, '<', $profile_path or die;
+my @profiles = map { decode_json($_) } grep { /^\{/ } <$profile_file>;
+close $profile_file;
+is scalar @profiles, scalar @photos, 'un profil par photo';
+
+# Même analyse que kakeibo.receipt.parse_receipt.
+sub parse_receipt {
+	my ($text) = @_;
+	my ($date, $total);
+	if ($text =~ /\b(20\d\d)\D([01]?\d)\D([0123]?\d)\b/) {
+		$date = sprintf '%d-%02d-%02d', $1, $2, $3;
+	}
+	if ($text =~ /^合.*￥(\d+(?:\D?\d{3})*)$/m) {
+		($total = $1) =~ s/\D//g;
+		$total += 0;
+	}
+	return defined $date && defined $total ? "$date\t$total" : undef;
+}
+
+# Les reçus sont écrits dans l’ordre des photos, et le profil de chaque photo
+# indique combien elle en contient.
+my ($expected_receipts, $detected_photos, $expected_pairs, $read_pairs) = (0, 0, 0, 0);
+my @latencies;
+for my $i (0 .. $#photos) {
+	my $photo = $photos[$i];
+	my $profile = $profiles[$i] // {};
+	my $count = $profile->{receipts} // 0;
+	push @latencies, $profile->{wall_ms} // 0;
+	my %got = map { (parse_receipt($_) // '') => 1 } splice @receipts, 0, $count;
+
+	my @pairs = @{$wanted{$photo}};
+	$expected_receipts += @pairs;
+	++$detected_photos if $count == @pairs;
+	next unless $decoding;
+	for (@pairs) {
+		++$expected_pairs;
+		++$read_pairs if $got{$_};
+	}
+}
+
+my $receipt_count = 0;
+$receipt_count += $_->{receipts} // 0 for @profiles;
+
+sub percentile {
+	my ($p, @values) = @_;
+	@values = sort { $a <=> $b } @values;
+	my $rank = ceil($p / 100 * @values) - 1;
+	return $values[$rank < 0 ? 0 : $rank];
+}
+
+my %measures = (
+	photos_per_s => @photos / $elapsed,
+	receipts_per_s => $receipt_count / $elapsed,
+	p50_ms => percentile(50, @latencies),
+	p99_ms => percentile(99, @latencies),
+	detection_accuracy => $detected_photos / @photos,
+);
+$measures{reading_accuracy} = $read_pairs / $expected_pairs if $decoding && $expected_pairs;
+diag sprintf '%-20s %.3f', $_, $measures{$_} for sort keys %measures;
+diag sprintf '%d photos, %d reçus trouvés sur %d attendus', scalar @photos, $receipt_count, $expected_receipts;
+
+if ($updating) {
+	open my $baseline, '>', $baseline_path or die "Impossible d’écrire $baseline_path : $!";
+	print $baseline "$_ $measures{$_}\n" for sort keys %measures;
+	close $baseline;
+	diag "Mesures enregistrées dans $baseline_path.";
+	done_testing;
+	exit;
+}
+
+open my $baseline, '<', $baseline_path or die "Impossible de lire $baseline_path : $!";
+my %reference = map { split ' ' } <$baseline>;
+close $baseline;
+
+for my $rate (qw(photos_per_s receipts_per_s)) {
+	next unless $reference{$rate};
+	cmp_ok $measures{$rate}, '>=', $reference{$rate} * (1 - $tolerance),
+		"$rate ne baisse pas de plus de ${\($tolerance * 100)} %";
+}
+for my $accuracy (qw(detection_accuracy reading_accuracy)) {
+	next unless defined $reference{$accuracy} && defined $measures{$accuracy};
+	cmp_ok $measures{$accuracy}, '>=', $reference{$accuracy}, "$accuracy ne baisse pas";
+}
+done_testing;